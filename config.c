@@ -20,6 +20,12 @@
 
 struct config config = {
 	.databasepath   = VARDIR "/imgup/imgup.db",
+	.storage        = "sqlite",
+	.blobdir        = VARDIR "/imgup/blobs",
 	.themedir       = SHAREDIR "/imgup/themes/minimal",
-	.verbosity      = 1
+	.verbosity      = 1,
+	.synchronous    = "normal",
+	.cachesize      = -2000,
+	.mmapsize       = 0,
+	.walautocheckpoint = 1000
 };
@@ -26,7 +26,24 @@
 extern struct config {
 	char themedir[PATH_MAX];
 	char databasepath[PATH_MAX];
+	char storage[8];
+	char blobdir[PATH_MAX];
+	char writer[PATH_MAX];
+	char address[256];
+	char sendfile[32];
 	enum log_level verbosity;
+
+	/* SQLite tuning, see the PRAGMA of the same name. */
+	char synchronous[8];
+	long long cachesize;
+	long long mmapsize;
+	int walautocheckpoint;
+
+	/* FastCGI worker pool, 0 workers to serve from the main process. */
+	unsigned int workers;
+	unsigned int threads;
+	unsigned long maxrequests;
+	long maxrss;
 } config;
 
 #endif /* !IMGUP_CONFIG_H */
@@ -17,22 +17,58 @@
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 
 #include <sqlite3.h>
 
+#include "config.h"
 #include "database.h"
 #include "image.h"
 #include "log.h"
+#include "sha256.h"
+#include "storage-fs.h"
+#include "storage-pack.h"
+#include "storage-sqlite.h"
 #include "util.h"
 
-static sqlite3 *db;
+/*
+ * Pages only read through rdb, opened read-only, while wdb is only used to
+ * upgrade the schema, insert and clear images. The latter is not opened at
+ * all for read-only access.
+ *
+ * Connections and statements are per thread, every thread calls
+ * database_open and database_finish on its own.
+ */
+static _Thread_local sqlite3 *rdb, *wdb;
 
-static const char *sql_init =
-	"BEGIN EXCLUSIVE TRANSACTION;\n"
-	"\n"
+/*
+ * Every backend is opened so that images stay readable after changing the
+ * storage, only the selected one receives new images. The last entry is
+ * only set by unit tests through database_register_storage.
+ */
+static const struct storage *storages[] = {
+	&storage_sqlite,
+	&storage_fs,
+	&storage_pack,
+	NULL
+};
+
+static _Thread_local const struct storage *storage;
+
+/*
+ * Schema migrations, each entry upgrades the database from the version equal
+ * to its index to the next one and the result is stored in PRAGMA
+ * user_version. Databases created before versioning report 0 and may already
+ * contain the original image table.
+ */
+static const char * const sql_migrations[] = {
+	/* 0 -> 1: original schema. */
 	"CREATE TABLE IF NOT EXISTS image(\n"
 	"  id TEXT PRIMARY KEY,\n"
 	"  title TEXT,\n"
@@ -42,75 +78,411 @@ static const char *sql_init =
 	"  date INT DEFAULT CURRENT_TIMESTAMP,\n"
 	"  visible INTEGER DEFAULT 0,\n"
 	"  duration INT\n"
+	");\n",
+
+	/*
+	 * 1 -> 2: move image bytes into their own table so that listing pages
+	 * only walk small metadata rows.
+	 */
+	"ALTER TABLE image RENAME TO image_old;\n"
+	"\n"
+	"CREATE TABLE image(\n"
+	"  id TEXT PRIMARY KEY,\n"
+	"  title TEXT,\n"
+	"  author TEXT,\n"
+	"  filename TEXT,\n"
+	"  size INT,\n"
+	"  date INT DEFAULT CURRENT_TIMESTAMP,\n"
+	"  visible INTEGER DEFAULT 0,\n"
+	"  duration INT\n"
+	");\n"
+	"\n"
+	"CREATE TABLE image_data(\n"
+	"  id TEXT PRIMARY KEY,\n"
+	"  data BLOB\n"
+	");\n"
+	"\n"
+	"INSERT INTO image(id, title, author, filename, size, date, visible, duration)\n"
+	"     SELECT id, title, author, filename, LENGTH(data), date, visible, duration\n"
+	"       FROM image_old;\n"
+	"\n"
+	"INSERT INTO image_data(id, data)\n"
+	"     SELECT id, data\n"
+	"       FROM image_old;\n"
+	"\n"
+	"DROP TABLE image_old;\n"
+	"\n"
+	"CREATE TRIGGER image_delete AFTER DELETE ON image\n"
+	"BEGIN\n"
+	"  DELETE FROM image_data WHERE id = old.id;\n"
+	"END;\n",
+
+	/*
+	 * 2 -> 3: index the listing order and the expiration instant so that
+	 * neither recents, search nor clear scan the whole table.
+	 */
+	"CREATE INDEX image_visible_date ON image(visible, date);\n"
+	"\n"
+	"CREATE INDEX image_expiration ON image(strftime('%s', date) + duration);\n",
+
+	/*
+	 * 3 -> 4: store the expiration instant once rather than computing it
+	 * from the text date for every row.
+	 */
+	"ALTER TABLE image ADD COLUMN expires_at INT;\n"
+	"\n"
+	"UPDATE image SET expires_at = strftime('%s', date) + duration;\n"
+	"\n"
+	"DROP INDEX image_expiration;\n"
+	"\n"
+	"CREATE INDEX image_expires_at ON image(expires_at);\n",
+
+	/*
+	 * 4 -> 5: store dates as seconds since epoch instead of the text
+	 * CURRENT_TIMESTAMP, the table is rebuilt to drop that default.
+	 */
+	"ALTER TABLE image RENAME TO image_old;\n"
+	"\n"
+	"CREATE TABLE image(\n"
+	"  id TEXT PRIMARY KEY,\n"
+	"  title TEXT,\n"
+	"  author TEXT,\n"
+	"  filename TEXT,\n"
+	"  size INTEGER,\n"
+	"  date INTEGER NOT NULL,\n"
+	"  visible INTEGER DEFAULT 0,\n"
+	"  duration INTEGER,\n"
+	"  expires_at INTEGER\n"
 	");\n"
 	"\n"
-	"END TRANSACTION";
+	"INSERT INTO image(id, title, author, filename, size, date, visible, duration, expires_at)\n"
+	"     SELECT id, title, author, filename, size, CAST(strftime('%s', date) AS INTEGER),\n"
+	"            visible, duration, expires_at\n"
+	"       FROM image_old;\n"
+	"\n"
+	"DROP TABLE image_old;\n"
+	"\n"
+	"CREATE INDEX image_visible_date ON image(visible, date);\n"
+	"\n"
+	"CREATE INDEX image_expires_at ON image(expires_at);\n"
+	"\n"
+	"CREATE TRIGGER image_delete AFTER DELETE ON image\n"
+	"BEGIN\n"
+	"  DELETE FROM image_data WHERE id = old.id;\n"
+	"END;\n",
 
-static const char *sql_get =
+	/*
+	 * 5 -> 6: full text index on public titles and authors, the trigram
+	 * tokenizer matches any substring of at least three characters.
+	 */
+	"CREATE VIRTUAL TABLE image_search USING fts5(\n"
+	"  title,\n"
+	"  author,\n"
+	"  tokenize = 'trigram'\n"
+	");\n"
+	"\n"
+	"INSERT INTO image_search(rowid, title, author)\n"
+	"     SELECT rowid, title, author\n"
+	"       FROM image\n"
+	"      WHERE visible = 1;\n"
+	"\n"
+	"CREATE TRIGGER image_search_insert AFTER INSERT ON image WHEN new.visible = 1\n"
+	"BEGIN\n"
+	"  INSERT INTO image_search(rowid, title, author)\n"
+	"       VALUES (new.rowid, new.title, new.author);\n"
+	"END;\n"
+	"\n"
+	"CREATE TRIGGER image_search_delete AFTER DELETE ON image WHEN old.visible = 1\n"
+	"BEGIN\n"
+	"  DELETE FROM image_search WHERE rowid = old.rowid;\n"
+	"END;\n",
+
+	/*
+	 * 6 -> 7: listings are paginated on (date, id), the id breaks ties
+	 * between images uploaded in the same second.
+	 */
+	"DROP INDEX image_visible_date;\n"
+	"\n"
+	"CREATE INDEX image_visible_date ON image(visible, date, id);\n",
+
+	/*
+	 * 7 -> 8: SHA-256 of the image data, used as file name when it is
+	 * stored on the file system.
+	 */
+	"ALTER TABLE image ADD COLUMN hash TEXT;\n"
+	"\n"
+	"CREATE INDEX image_hash ON image(hash);\n",
+
+	/*
+	 * 8 -> 9: location of the images appended to pack files, ordered by
+	 * pack so that compaction reads them sequentially.
+	 */
+	"CREATE TABLE image_pack(\n"
+	"  id TEXT PRIMARY KEY,\n"
+	"  pack INTEGER NOT NULL,\n"
+	"  start INTEGER NOT NULL,\n"
+	"  length INTEGER NOT NULL\n"
+	");\n"
+	"\n"
+	"CREATE INDEX image_pack_pack ON image_pack(pack, start);\n"
+	"\n"
+	"CREATE TRIGGER image_pack_delete AFTER DELETE ON image\n"
+	"BEGIN\n"
+	"  DELETE FROM image_pack WHERE id = old.id;\n"
+	"END;\n",
+
+	/*
+	 * 9 -> 10: identical images share their data, it is stored once per
+	 * hash and the number of images using it is counted in blob. Images
+	 * stored before hashing use their id as key instead.
+	 */
+	"CREATE TABLE blob(\n"
+	"  hash TEXT PRIMARY KEY,\n"
+	"  refs INTEGER NOT NULL\n"
+	");\n"
+	"\n"
+	"INSERT INTO blob(hash, refs)\n"
+	"     SELECT COALESCE(hash, id), COUNT(*)\n"
+	"       FROM image\n"
+	"      GROUP BY 1;\n"
+	"\n"
+	"CREATE INDEX blob_refs ON blob(refs);\n"
+	"\n"
+	"DROP TRIGGER image_delete;\n"
+	"\n"
+	"DROP TRIGGER image_pack_delete;\n"
+	"\n"
+	"ALTER TABLE image_data RENAME COLUMN id TO blob;\n"
+	"\n"
+	"ALTER TABLE image_pack RENAME COLUMN id TO blob;\n"
+	"\n"
+	"UPDATE OR REPLACE image_data\n"
+	"   SET blob = (SELECT hash FROM image WHERE image.id = image_data.blob)\n"
+	" WHERE blob IN (SELECT id FROM image WHERE hash IS NOT NULL);\n"
+	"\n"
+	"UPDATE OR REPLACE image_pack\n"
+	"   SET blob = (SELECT hash FROM image WHERE image.id = image_pack.blob)\n"
+	" WHERE blob IN (SELECT id FROM image WHERE hash IS NOT NULL);\n"
+	"\n"
+	"CREATE TRIGGER image_blob_insert AFTER INSERT ON image\n"
+	"BEGIN\n"
+	"  INSERT INTO blob(hash, refs)\n"
+	"       VALUES (COALESCE(new.hash, new.id), 1)\n"
+	"           ON CONFLICT (hash) DO UPDATE SET refs = refs + 1;\n"
+	"END;\n"
+	"\n"
+	"CREATE TRIGGER image_blob_delete AFTER DELETE ON image\n"
+	"BEGIN\n"
+	"  UPDATE blob SET refs = refs - 1 WHERE hash = COALESCE(old.hash, old.id);\n"
+	"END;\n",
+
+	/*
+	 * 10 -> 11: identifiers are stored as the rowid, their text form is
+	 * the same number in base 36. Images stored before hashing keep their
+	 * former id in hash as it is the key of their data.
+	 */
+	"ALTER TABLE image RENAME TO image_old;\n"
+	"\n"
+	"CREATE TABLE image(\n"
+	"  id INTEGER PRIMARY KEY,\n"
+	"  title TEXT,\n"
+	"  author TEXT,\n"
+	"  filename TEXT,\n"
+	"  size INTEGER,\n"
+	"  date INTEGER NOT NULL,\n"
+	"  visible INTEGER DEFAULT 0,\n"
+	"  duration INTEGER,\n"
+	"  expires_at INTEGER,\n"
+	"  hash TEXT NOT NULL\n"
+	");\n"
+	"\n"
+	"INSERT INTO image(id, title, author, filename, size, date, visible, duration, expires_at, hash)\n"
+	"     SELECT imgup_id(id), title, author, filename, size, date, visible, duration,\n"
+	"            expires_at, COALESCE(hash, id)\n"
+	"       FROM image_old;\n"
+	"\n"
+	"DROP TABLE image_old;\n"
+	"\n"
+	"CREATE INDEX image_visible_date ON image(visible, date, id);\n"
+	"\n"
+	"CREATE INDEX image_expires_at ON image(expires_at);\n"
+	"\n"
+	"CREATE INDEX image_hash ON image(hash);\n"
+	"\n"
+	"DELETE FROM image_search;\n"
+	"\n"
+	"INSERT INTO image_search(rowid, title, author)\n"
+	"     SELECT id, title, author\n"
+	"       FROM image\n"
+	"      WHERE visible = 1;\n"
+	"\n"
+	"CREATE TRIGGER image_search_insert AFTER INSERT ON image WHEN new.visible = 1\n"
+	"BEGIN\n"
+	"  INSERT INTO image_search(rowid, title, author)\n"
+	"       VALUES (new.id, new.title, new.author);\n"
+	"END;\n"
+	"\n"
+	"CREATE TRIGGER image_search_delete AFTER DELETE ON image WHEN old.visible = 1\n"
+	"BEGIN\n"
+	"  DELETE FROM image_search WHERE rowid = old.id;\n"
+	"END;\n"
+	"\n"
+	"CREATE TRIGGER image_blob_insert AFTER INSERT ON image\n"
+	"BEGIN\n"
+	"  INSERT INTO blob(hash, refs)\n"
+	"       VALUES (new.hash, 1)\n"
+	"           ON CONFLICT (hash) DO UPDATE SET refs = refs + 1;\n"
+	"END;\n"
+	"\n"
+	"CREATE TRIGGER image_blob_delete AFTER DELETE ON image\n"
+	"BEGIN\n"
+	"  UPDATE blob SET refs = refs - 1 WHERE hash = old.hash;\n"
+	"END;\n"
+};
+
+static const char sql_get[] =
 	"SELECT id\n"
 	"     , title\n"
 	"     , author\n"
-	"     , data\n"
-	"     , LENGTH(data) AS length\n"
+	"     , size\n"
 	"     , filename\n"
-	"     , strftime('%s', date) AS date\n"
+	"     , date\n"
 	"     , visible\n"
 	"     , duration\n"
+	"     , expires_at\n"
+	"     , hash\n"
 	"  FROM image\n"
 	" WHERE id = ?";
 
-static const char *sql_insert =
+static const char sql_insert[] =
 	"INSERT INTO image(\n"
 	"  id,\n"
 	"  title,\n"
 	"  author,\n"
-	"  data,\n"
 	"  filename,\n"
+	"  size,\n"
+	"  date,\n"
 	"  visible,\n"
-	"  duration\n"
-	") VALUES (?, ?, ?, ?, ?, ?, ?)";
+	"  duration,\n"
+	"  expires_at,\n"
+	"  hash\n"
+	") VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?)";
 
-static const char *sql_recents =
+static const char sql_recents[] =
 	"SELECT id\n"
 	"     , title\n"
 	"     , author\n"
-	"     , data\n"
-	"     , LENGTH(data) AS length\n"
+	"     , size\n"
 	"     , filename\n"
-	"     , strftime('%s', date) AS date\n"
+	"     , date\n"
 	"     , visible\n"
 	"     , duration\n"
+	"     , expires_at\n"
+	"     , hash\n"
 	"  FROM image\n"
 	" WHERE visible = 1\n"
-	" ORDER BY date DESC\n"
+	"   AND (date, id) < (?, ?)\n"
+	" ORDER BY date DESC, id DESC\n"
 	" LIMIT ?\n";
 
-static const char *sql_clear =
-	"BEGIN EXCLUSIVE TRANSACTION;\n"
-	"\n"
+static const char sql_clear[] =
 	"DELETE\n"
 	"  FROM image\n"
-	" WHERE strftime('%s', 'now') - strftime('%s', date) >= duration;"
-	"\n"
-	"END TRANSACTION";
+	" WHERE expires_at <= ?";
 
-static const char *sql_search =
-	"SELECT id\n"
-	"     , title\n"
-	"     , author\n"
-	"     , data\n"
-	"     , LENGTH(data)\n"
-	"     , filename\n"
-	"     , strftime('%s', date) AS date\n"
-	"     , visible\n"
-	"     , duration\n"
-	"  FROM image\n"
-	" WHERE title LIKE ?\n"
-	"   AND author LIKE ?\n"
-	"   AND visible = 1\n"
-	" ORDER BY date DESC\n"
+/* Data no image refers to anymore, once the rows are cleared. */
+static const char sql_unused[] =
+	"SELECT hash\n"
+	"  FROM blob\n"
+	" WHERE refs <= 0";
+
+static const char sql_unused_delete[] =
+	"DELETE\n"
+	"  FROM blob\n"
+	" WHERE refs <= 0";
+
+static const char sql_search[] =
+	"SELECT image.id\n"
+	"     , image.title\n"
+	"     , image.author\n"
+	"     , image.size\n"
+	"     , image.filename\n"
+	"     , image.date\n"
+	"     , image.visible\n"
+	"     , image.duration\n"
+	"     , image.expires_at\n"
+	"     , image.hash\n"
+	"  FROM image_search\n"
+	"  JOIN image ON image.id = image_search.rowid\n"
+	" WHERE image_search MATCH ?\n"
+	"   AND (image.date, image.id) < (?, ?)\n"
+	" ORDER BY image.date DESC, image.id DESC\n"
 	" LIMIT ?\n";
 
+/*
+ * Trigrams can't match text shorter than three characters, in that case the
+ * search falls back to a LIKE on the index which is then scanned.
+ */
+static const char sql_search_like[] =
+	"SELECT image.id\n"
+	"     , image.title\n"
+	"     , image.author\n"
+	"     , image.size\n"
+	"     , image.filename\n"
+	"     , image.date\n"
+	"     , image.visible\n"
+	"     , image.duration\n"
+	"     , image.expires_at\n"
+	"     , image.hash\n"
+	"  FROM image_search\n"
+	"  JOIN image ON image.id = image_search.rowid\n"
+	" WHERE image_search.title LIKE '%' || ? || '%' ESCAPE '\\'\n"
+	"   AND image_search.author LIKE '%' || ? || '%' ESCAPE '\\'\n"
+	"   AND (image.date, image.id) < (?, ?)\n"
+	" ORDER BY image.date DESC, image.id DESC\n"
+	" LIMIT ?\n";
+
+enum stmt {
+	STMT_GET,
+	STMT_INSERT,
+	STMT_RECENTS,
+	STMT_SEARCH,
+	STMT_SEARCH_LIKE,
+	STMT_CLEAR,
+	STMT_UNUSED,
+	STMT_UNUSED_DELETE,
+	STMT_NUM        /* Not used. */
+};
+
+/*
+ * Statements are prepared once in database_open and kept until
+ * database_finish so that FastCGI mode does not compile the same queries on
+ * every request. They must be reset after use. Those that write are
+ * prepared on the writer connection only.
+ */
+static _Thread_local struct {
+	const char *name;
+	const char *sql;
+	bool write;
+	sqlite3_stmt *handle;
+} stmts[] = {
+	[STMT_GET]              = { "get",           sql_get,           false },
+	[STMT_INSERT]           = { "insert",        sql_insert,        true  },
+	[STMT_RECENTS]          = { "recents",       sql_recents,       false },
+	[STMT_SEARCH]           = { "search",        sql_search,        false },
+	[STMT_SEARCH_LIKE]      = { "search_like",   sql_search_like,   false },
+	[STMT_CLEAR]            = { "clear",         sql_clear,         true  },
+	[STMT_UNUSED]           = { "unused",        sql_unused,        true  },
+	[STMT_UNUSED_DELETE]    = { "unused_delete", sql_unused_delete, true  }
+};
+
+static void
+reset(sqlite3_stmt *stmt)
+{
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+}
+
 /* sqlite3 use const unsigned char *. */
 static char *
 dup(const unsigned char *s)
@@ -118,108 +490,359 @@ dup(const unsigned char *s)
 	return estrdup(s ? (const char *)(s) : "");
 }
 
+/*
+ * Identifiers are shown as 12 digits in base 36, which fits in the 64 bits
+ * of the rowid. The digits are in ASCII order so that both forms sort the
+ * same way.
+ */
+static const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+
+#define ID_LEN  12
+#define ID_BASE (sizeof (digits) - 1)
+
+static bool
+decode(const char *id, sqlite3_int64 *value)
+{
+	const char *p;
+
+	if (strlen(id) != ID_LEN)
+		return false;
+
+	for (*value = 0; *id; ++id) {
+		if (!(p = strchr(digits, *id)))
+			return false;
+
+		*value = *value * ID_BASE + (p - digits);
+	}
+
+	return true;
+}
+
+static char *
+encode(sqlite3_int64 value)
+{
+	char id[ID_LEN + 1] = {0};
+
+	for (int i = ID_LEN - 1; i >= 0; --i) {
+		id[i] = digits[value % ID_BASE];
+		value /= ID_BASE;
+	}
+
+	return estrdup(id);
+}
+
+/* SQL function converting the former text identifiers in migrations. */
+static void
+decode_sql(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+	sqlite3_int64 value;
+
+	(void)argc;
+
+	if (sqlite3_value_type(argv[0]) == SQLITE_TEXT &&
+	    decode((const char *)sqlite3_value_text(argv[0]), &value))
+		sqlite3_result_int64(ctx, value);
+	else
+		sqlite3_result_null(ctx);
+}
+
+/*
+ * Convert the metadata columns common to every SELECT, image data is left
+ * unset.
+ */
 static void
 convert(sqlite3_stmt *stmt, struct image *image)
 {
-	image->id = dup(sqlite3_column_text(stmt, 0));
+	image->id = encode(sqlite3_column_int64(stmt, 0));
 	image->title = dup(sqlite3_column_text(stmt, 1));
 	image->author = dup(sqlite3_column_text(stmt, 2));
-	image->datasz = sqlite3_column_int64(stmt, 4);
-	image->data = ememdup(sqlite3_column_blob(stmt, 3), image->datasz);
-	image->filename = dup(sqlite3_column_text(stmt, 5));
-	image->timestamp = sqlite3_column_int64(stmt, 6);
-	image->visible = sqlite3_column_int(stmt, 7);
-	image->duration = sqlite3_column_int64(stmt, 8);
+	image->datasz = sqlite3_column_int64(stmt, 3);
+	image->filename = dup(sqlite3_column_text(stmt, 4));
+	image->timestamp = sqlite3_column_int64(stmt, 5);
+	image->visible = sqlite3_column_int(stmt, 6);
+	image->duration = sqlite3_column_int64(stmt, 7);
+	image->expires = sqlite3_column_int64(stmt, 8);
+
+	if (sqlite3_column_type(stmt, 9) != SQLITE_NULL)
+		image->hash = dup(sqlite3_column_text(stmt, 9));
 }
 
-static bool
-exists(const char *id)
+static int
+version(sqlite3 *db)
 {
-	assert(id);
-
 	sqlite3_stmt *stmt = NULL;
-	bool ret = true;
+	int ret = -1;
 
-	if (sqlite3_prepare(db, sql_get, -1, &stmt, NULL) == SQLITE_OK) {
-		sqlite3_bind_text(stmt, 1, id, -1, NULL);
-		ret = sqlite3_step(stmt) == SQLITE_ROW;
-		sqlite3_finalize(stmt);
-	}
+	if (sqlite3_prepare_v2(db, "PRAGMA user_version", -1, &stmt, NULL) != SQLITE_OK)
+		return -1;
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		ret = sqlite3_column_int(stmt, 0);
+
+	sqlite3_finalize(stmt);
 
 	return ret;
 }
 
-static const char *
-create_id(void)
+static bool
+migrate(void)
 {
-	static const char table[] = "abcdefghijklmnopqrstuvwxyz1234567890";
-	static char id[12];
+	int current;
 
-	for (size_t i = 0; i < sizeof (id); ++i)
-		id[i] = table[rand() % (sizeof (table) - 1)];
+	/* Most of the time, nothing to do and no reason to lock. */
+	if (version(wdb) == (int)NELEM(sql_migrations))
+		return true;
+	if (sqlite3_exec(wdb, "BEGIN EXCLUSIVE TRANSACTION", NULL, NULL, NULL) != SQLITE_OK)
+		return false;
+	if ((current = version(wdb)) < 0)
+		goto sqlite_err;
+	if ((size_t)current > NELEM(sql_migrations)) {
+		log_warn("database: schema version %d is not supported", current);
+		sqlite3_exec(wdb, "ROLLBACK", NULL, NULL, NULL);
+		return false;
+	}
+
+	for (size_t i = current; i < NELEM(sql_migrations); ++i) {
+		log_info("database: upgrading schema to version %zu", i + 1);
+
+		if (sqlite3_exec(wdb, sql_migrations[i], NULL, NULL, NULL) != SQLITE_OK)
+			goto sqlite_err;
+	}
+
+	if (sqlite3_exec(wdb, bprintf("PRAGMA user_version = %zu",
+	    NELEM(sql_migrations)), NULL, NULL, NULL) != SQLITE_OK)
+		goto sqlite_err;
+
+	return sqlite3_exec(wdb, "COMMIT", NULL, NULL, NULL) == SQLITE_OK;
 
-	return id;
+sqlite_err:
+	sqlite3_exec(wdb, "ROLLBACK", NULL, NULL, NULL);
+
+	return false;
 }
 
+/*
+ * Switch to write-ahead logging so that readers never wait for a writer and
+ * apply the user tunables, the journal mode is persistent in the file while
+ * the other ones must be set on every connection. Read-only connections
+ * can't change the journal mode and use the one set by writers.
+ *
+ * The page cache and memory mapping sizes only apply to the reader which
+ * walks the listings and image data, the writer only touches a few pages
+ * per upload and keeps the SQLite defaults.
+ */
 static bool
+tune(sqlite3 *db, bool readonly)
+{
+	static const char * const levels[] = { "off", "normal", "full", "extra" };
+	size_t i;
+
+	for (i = 0; i < NELEM(levels); ++i)
+		if (strcasecmp(config.synchronous, levels[i]) == 0)
+			break;
+
+	if (i == NELEM(levels)) {
+		log_warn("database: invalid synchronous level: %s", config.synchronous);
+		return false;
+	}
+
+	return sqlite3_exec(db, bprintf(
+	    "%s"
+	    "PRAGMA synchronous = %s;\n"
+	    "PRAGMA cache_size = %lld;\n"
+	    "PRAGMA mmap_size = %lld;\n"
+	    "PRAGMA wal_autocheckpoint = %d;\n",
+	    readonly ? "" : "PRAGMA journal_mode = WAL;\n",
+	    levels[i],
+	    readonly ? config.cachesize : -2000LL,
+	    readonly ? config.mmapsize : 0LL,
+	    config.walautocheckpoint), NULL, NULL, NULL) == SQLITE_OK;
+}
+
+/*
+ * Identifiers come from the SQLite pseudo-random generator which is seeded
+ * from the operating system entropy, unlike rand() processes started in the
+ * same second don't produce the same ones.
+ */
+static sqlite3_int64
 set_id(struct image *image)
 {
-	assert(image);
+	sqlite3_int64 value = 0;
+	unsigned char c;
 
-	image->id = NULL;
+	for (size_t i = 0; i < ID_LEN; ) {
+		sqlite3_randomness(1, &c);
 
-	/*
-	 * Avoid infinite loop, we only try to create a new id in 30 steps.
-	 *
-	 * On error, the function `exist` returns true to indicate we should
-	 * not try to save with that id.
-	 */
-	int tries = 0;
+		/* Drop the values that would make some digits likelier. */
+		if (c < 256 - 256 % ID_BASE) {
+			value = value * ID_BASE + c % ID_BASE;
+			i++;
+		}
+	}
 
-	do {
-		free(image->id);
-		image->id = estrdup(create_id());
-	} while (++tries < 30 && exists(image->id));
+	free(image->id);
+	image->id = encode(value);
 
-	return tries < 30;
+	return value;
 }
 
-bool
-database_open(const char *path)
+static bool
+connection(sqlite3 **db, const char *path, bool readonly)
 {
-	assert(path);
-
-	log_info("database: opening %s", path);
+	const int flags = readonly ? SQLITE_OPEN_READONLY :
+	    SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
 
-	if (sqlite3_open(path, &db) != SQLITE_OK) {
-		log_warn("database: unable to open %s: %s", path, sqlite3_errmsg(db));
+	if (sqlite3_open_v2(path, db, flags, NULL) != SQLITE_OK) {
+		log_warn("database: unable to open %s: %s", path, sqlite3_errmsg(*db));
 		return false;
 	}
 
 	/* Wait for 30 seconds to lock the database. */
-	sqlite3_busy_timeout(db, 30000);
+	sqlite3_busy_timeout(*db, 30000);
+	sqlite3_create_function(*db, "imgup_id", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+	    NULL, decode_sql, NULL, NULL);
 
-	if (sqlite3_exec(db, sql_init, NULL, NULL, NULL) != SQLITE_OK) {
-		log_warn("database: unable to initialize %s: %s", path, sqlite3_errmsg(db));
+	if (!tune(*db, readonly)) {
+		log_warn("database: unable to configure %s: %s", path, sqlite3_errmsg(*db));
 		return false;
 	}
 
 	return true;
 }
 
+static bool
+opendb(const char *path, bool readonly)
+{
+	sqlite3 *db;
+
+	log_info("database: opening %s%s", path, readonly ? " (read-only)" : "");
+
+	storage = NULL;
+
+	for (size_t i = 0; !storage && i < NELEM(storages) && storages[i]; ++i)
+		if (strcmp(config.storage, storages[i]->name) == 0)
+			storage = storages[i];
+
+	if (!storage) {
+		log_warn("database: invalid storage: %s", config.storage);
+		return false;
+	}
+
+	/* The writer comes first as it creates and upgrades the database. */
+	if (!readonly) {
+		if (!connection(&wdb, path, false))
+			return false;
+		if (!migrate()) {
+			log_warn("database: unable to initialize %s: %s", path, sqlite3_errmsg(wdb));
+			return false;
+		}
+	}
+
+	/* Nothing uploaded yet, the file is created by a normal open. */
+	if (!connection(&rdb, path, true)) {
+		if (!readonly || sqlite3_errcode(rdb) != SQLITE_CANTOPEN)
+			return false;
+
+		log_info("database: %s does not exist yet", path);
+		database_finish();
+		return opendb(path, false);
+	}
+
+	/* Upgrading requires writing, reopen normally if needed. */
+	if (readonly && version(rdb) != (int)NELEM(sql_migrations)) {
+		log_info("database: schema of %s is not up to date", path);
+		database_finish();
+		return opendb(path, false);
+	}
+
+	for (size_t i = 0; i < NELEM(stmts); ++i) {
+		if (!(db = stmts[i].write ? wdb : rdb))
+			continue;
+		if (sqlite3_prepare_v3(db, stmts[i].sql, -1, SQLITE_PREPARE_PERSISTENT,
+		    &stmts[i].handle, NULL) != SQLITE_OK) {
+			log_warn("database: unable to prepare statement: %s", sqlite3_errmsg(db));
+			return false;
+		}
+	}
+
+	for (size_t i = 0; i < NELEM(storages) && storages[i]; ++i)
+		if (!storages[i]->open(rdb, wdb))
+			return false;
+
+	return true;
+}
+
+void
+database_register_storage(const struct storage *backend)
+{
+	assert(backend);
+
+	storages[NELEM(storages) - 1] = backend;
+}
+
+bool
+database_open(const char *path)
+{
+	assert(path);
+
+	return opendb(path, false);
+}
+
+bool
+database_open_readonly(const char *path)
+{
+	assert(path);
+
+	return opendb(path, true);
+}
+
+/*
+ * Bind the pagination cursor at the given column and the next one, without
+ * cursor every date is lower than the maximum.
+ */
+static int
+bind_before(sqlite3_stmt *stmt, int col, const struct image *before)
+{
+	sqlite3_int64 id;
+	int rc;
+
+	if (!before) {
+		if ((rc = sqlite3_bind_int64(stmt, col, INT64_MAX)) == SQLITE_OK)
+			rc = sqlite3_bind_int64(stmt, col + 1, INT64_MAX);
+	} else {
+		if (!decode(before->id, &id))
+			return SQLITE_MISMATCH;
+		if ((rc = sqlite3_bind_int64(stmt, col, before->timestamp)) == SQLITE_OK)
+			rc = sqlite3_bind_int64(stmt, col + 1, id);
+	}
+
+	return rc;
+}
+
+bool
+database_isid(const char *id)
+{
+	assert(id);
+
+	sqlite3_int64 value;
+
+	return decode(id, &value);
+}
+
 bool
-database_recents(struct image *images, size_t *max)
+database_recents(struct image *images, size_t *max, const struct image *before)
 {
 	assert(images);
 	assert(max);
+	assert(!before || before->id);
 
-	sqlite3_stmt *stmt = NULL;
+	sqlite3_stmt *stmt = stmts[STMT_RECENTS].handle;
 
 	memset(images, 0, *max * sizeof (*images));
 	log_debug("database: accessing most recents");
 
-	if (sqlite3_prepare(db, sql_recents, -1, &stmt, NULL) != SQLITE_OK ||
-	    sqlite3_bind_int64(stmt, 1, *max) != SQLITE_OK)
+	if (bind_before(stmt, 1, before) != SQLITE_OK)
+		goto sqlite_err;
+	if (sqlite3_bind_int64(stmt, 3, *max) != SQLITE_OK)
 		goto sqlite_err;
 
 	size_t i = 0;
@@ -228,34 +851,51 @@ database_recents(struct image *images, size_t *max)
 		convert(stmt, &images[i]);
 
 	log_debug("database: found %zu images", i);
-	sqlite3_finalize(stmt);
+	reset(stmt);
 	*max = i;
 
 	return true;
 
 sqlite_err:
-	log_warn("database: error (recents): %s\n", sqlite3_errmsg(db));
-
-	if (stmt)
-		sqlite3_finalize(stmt);
+	log_warn("database: error (recents): %s\n", sqlite3_errmsg(rdb));
+	reset(stmt);
 
 	return (*max = 0);
 }
 
-bool
-database_get(struct image *image, const char *id)
+/*
+ * Find the backend holding the data, the selected one is tried first as it
+ * holds every new image.
+ */
+static const struct storage *
+find(const char *key)
 {
-	assert(image);
-	assert(id);
+	size_t datasz;
 
-	sqlite3_stmt* stmt = NULL;
+	if (storage->stat(key, &datasz))
+		return storage;
+
+	for (size_t i = 0; i < NELEM(storages) && storages[i]; ++i)
+		if (storages[i] != storage && storages[i]->stat(key, &datasz))
+			return storages[i];
+
+	return NULL;
+}
+
+static bool
+get(struct image *image, const char *id)
+{
+	sqlite3_stmt *stmt = stmts[STMT_GET].handle;
+	sqlite3_int64 value;
 	bool found = false;
 
 	memset(image, 0, sizeof (*image));
 	log_debug("database: accessing image with id: %s", id);
 
-	if (sqlite3_prepare(db, sql_get, -1, &stmt, NULL) != SQLITE_OK ||
-	    sqlite3_bind_text(stmt, 1, id, -1, NULL) != SQLITE_OK)
+	/* Can't exist. */
+	if (!decode(id, &value))
+		return false;
+	if (sqlite3_bind_int64(stmt, 1, value) != SQLITE_OK)
 		goto sqlite_err;
 
 	switch (sqlite3_step(stmt)) {
@@ -270,15 +910,163 @@ database_get(struct image *image, const char *id)
 		break;
 	}
 
-	sqlite3_finalize(stmt);
+	reset(stmt);
 
 	return found;
 
 sqlite_err:
-	if (stmt)
-		sqlite3_finalize(stmt);
+	log_warn("database: error (get): %s", sqlite3_errmsg(rdb));
+	reset(stmt);
 
-	log_warn("database: error (get): %s", sqlite3_errmsg(db));
+	return false;
+}
+
+bool
+database_get(struct image *image, const char *id)
+{
+	assert(image);
+	assert(id);
+
+	const struct storage *backend;
+
+	if (!get(image, id))
+		return false;
+	if (image->datasz && (backend = find(image->hash)))
+		image->data = backend->get(image->hash, &image->datasz);
+
+	return true;
+}
+
+bool
+database_get_meta(struct image *image, const char *id)
+{
+	assert(image);
+	assert(id);
+
+	return get(image, id);
+}
+
+bool
+database_stream(const char *id, database_stream_fn fn, void *arg)
+{
+	assert(id);
+	assert(fn);
+
+	const struct storage *backend;
+	struct image image;
+	bool ret = false;
+
+	log_debug("database: streaming image with id: %s", id);
+
+	if (get(&image, id) && (backend = find(image.hash)))
+		ret = backend->stream(image.hash, fn, arg);
+
+	image_finish(&image);
+
+	return ret;
+}
+
+bool
+database_locate(const char *id, char *path, size_t pathsz, off_t *offset, size_t *datasz)
+{
+	assert(id);
+	assert(path);
+	assert(offset);
+	assert(datasz);
+
+	const struct storage *backend;
+	const char *file;
+	struct image image;
+	bool ret = false;
+
+	if (get(&image, id) && (backend = find(image.hash)) && backend->locate &&
+	    backend->locate(image.hash, &file, offset, datasz))
+		ret = (size_t)snprintf(path, pathsz, "%s", file) < pathsz;
+
+	image_finish(&image);
+
+	return ret;
+}
+
+/*
+ * Tell if a previous image of the same batch stores the given data, it is
+ * not visible to the storage lookup until committed.
+ */
+static bool
+queued(const struct image *images, size_t imagesz, const char *hash)
+{
+	for (size_t i = 0; i < imagesz; ++i)
+		if (images[i].id && strcmp(images[i].hash, hash) == 0)
+			return true;
+
+	return false;
+}
+
+/*
+ * Insert a single image within the transaction of database_insert_all, the
+ * savepoint discards only this image on errors.
+ */
+static bool
+insert(struct image *image, time_t now, bool pending, bool *stored)
+{
+	sqlite3_stmt *stmt = stmts[STMT_INSERT].handle;
+
+	if (sqlite3_exec(wdb, "SAVEPOINT image", NULL, NULL, NULL) != SQLITE_OK)
+		goto sqlite_err;
+
+	/*
+	 * The primary key tells if the identifier is already used, in which
+	 * case another one is tried. Avoid infinite loop, there are only 30
+	 * attempts.
+	 */
+	for (int tries = 1; ; ++tries) {
+		sqlite3_bind_int64(stmt, 1, set_id(image));
+		sqlite3_bind_text(stmt, 2, image->title, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 3, image->author, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 4, image->filename, -1, SQLITE_STATIC);
+		sqlite3_bind_int64(stmt, 5, image->datasz);
+		sqlite3_bind_int64(stmt, 6, now);
+		sqlite3_bind_int(stmt, 7, image->visible);
+		sqlite3_bind_int64(stmt, 8, image->duration);
+		sqlite3_bind_int64(stmt, 9, now + image->duration);
+		sqlite3_bind_text(stmt, 10, image->hash, -1, SQLITE_STATIC);
+
+		if (sqlite3_step(stmt) == SQLITE_DONE)
+			break;
+		if (sqlite3_extended_errcode(wdb) != SQLITE_CONSTRAINT_PRIMARYKEY || tries == 30)
+			goto sqlite_err;
+
+		log_debug("database: identifier %s already used", image->id);
+		reset(stmt);
+	}
+
+	/*
+	 * Only new data is stored, while the database is locked so that
+	 * imgupd-clean can't remove it in the meantime.
+	 */
+	if (pending || find(image->hash))
+		log_debug("database: image data %s already stored", image->hash);
+	else if (!(*stored = storage->put(image->hash, image->data, image->datasz)))
+		goto sqlite_err;
+
+	reset(stmt);
+
+	return sqlite3_exec(wdb, "RELEASE image", NULL, NULL, NULL) == SQLITE_OK;
+
+sqlite_err:
+	log_warn("database: error (insert): %s", sqlite3_errmsg(wdb));
+	reset(stmt);
+	sqlite3_exec(wdb, "ROLLBACK TO image", NULL, NULL, NULL);
+	sqlite3_exec(wdb, "RELEASE image", NULL, NULL, NULL);
+
+	if (*stored)
+		storage->remove(image->hash);
+
+	*stored = false;
+	free(image->id);
+	free(image->hash);
+	image->id = NULL;
+	image->hash = NULL;
 
 	return false;
 }
@@ -288,97 +1076,197 @@ database_insert(struct image *image)
 {
 	assert(image);
 
-	sqlite3_stmt *stmt = NULL;
+	return database_insert_all(image, 1) == 1;
+}
 
-	log_debug("database: creating new image");
+size_t
+database_insert_all(struct image *images, size_t imagesz)
+{
+	assert(images);
 
-	if (sqlite3_exec(db, "BEGIN EXCLUSIVE TRANSACTION", NULL, NULL, NULL) != SQLITE_OK) {
-		log_warn("database: could not lock database: %s", sqlite3_errmsg(db));
-		return false;
+	const time_t now = time(NULL);
+	char hash[SHA256_HEX_LEN];
+	bool *stored;
+	size_t inserted = 0;
+
+	if (!wdb) {
+		log_warn("database: error (insert): opened read-only");
+		return 0;
 	}
 
-	if (!set_id(image)) {
-		log_warn("database: unable to randomize unique identifier");
-		sqlite3_exec(db, "END TRANSACTION", NULL, NULL, NULL);
-		return false;
+	log_debug("database: creating %zu new images", imagesz);
+
+	if (sqlite3_exec(wdb, "BEGIN IMMEDIATE TRANSACTION", NULL, NULL, NULL) != SQLITE_OK) {
+		log_warn("database: could not lock database: %s", sqlite3_errmsg(wdb));
+		return 0;
 	}
 
-	if (sqlite3_prepare(db, sql_insert, -1, &stmt, NULL) != SQLITE_OK)
-		goto sqlite_err;
+	if (!(stored = calloc(imagesz, sizeof (*stored))))
+		die("abort: %s", strerror(errno));
+
+	for (size_t i = 0; i < imagesz; ++i) {
+		sha256(images[i].data, images[i].datasz, hash);
+		free(images[i].id);
+		free(images[i].hash);
+		images[i].id = NULL;
+		images[i].hash = estrdup(hash);
 
-	sqlite3_bind_text(stmt, 1, image->id, -1, SQLITE_STATIC);
-	sqlite3_bind_text(stmt, 2, image->title, -1, SQLITE_STATIC);
-	sqlite3_bind_text(stmt, 3, image->author, -1, SQLITE_STATIC);
-	sqlite3_bind_blob(stmt, 4, image->data, image->datasz, NULL);
-	sqlite3_bind_text(stmt, 5, image->filename, -1, SQLITE_STATIC);
-	sqlite3_bind_int(stmt, 6, image->visible);
-	sqlite3_bind_int64(stmt, 7, image->duration);
+		if (insert(&images[i], now, queued(images, i, hash), &stored[i]))
+			inserted++;
+	}
 
-	if (sqlite3_step(stmt) != SQLITE_DONE)
+	if (sqlite3_exec(wdb, "COMMIT", NULL, NULL, NULL) != SQLITE_OK)
 		goto sqlite_err;
 
-	sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
-	sqlite3_finalize(stmt);
+	for (size_t i = 0; i < imagesz; ++i) {
+		if (!images[i].id)
+			continue;
 
-	log_info("database: new image (%s) from %s expires in one %lld seconds",
-	    image->id, image->author, image->duration);
+		images[i].timestamp = now;
+		images[i].expires = now + images[i].duration;
 
-	return true;
+		log_info("database: new image (%s) from %s expires in one %lld seconds",
+		    images[i].id, images[i].author, images[i].duration);
+	}
+
+	free(stored);
+
+	return inserted;
 
 sqlite_err:
-	log_warn("database: error (insert): %s", sqlite3_errmsg(db));
-	sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+	log_warn("database: error (insert): %s", sqlite3_errmsg(wdb));
+	sqlite3_exec(wdb, "ROLLBACK", NULL, NULL, NULL);
 
-	if (stmt)
-		sqlite3_finalize(stmt);
+	for (size_t i = 0; i < imagesz; ++i) {
+		if (stored[i])
+			storage->remove(images[i].hash);
 
-	free(image->id);
-	image->id = NULL;
+		free(images[i].id);
+		free(images[i].hash);
+		images[i].id = NULL;
+		images[i].hash = NULL;
+	}
 
-	return false;
+	free(stored);
+
+	return 0;
+}
+
+/*
+ * Append a column filter to the FTS5 expression, the text is quoted as a
+ * single string so that it is matched as-is. Too long text is truncated.
+ */
+static void
+match(char *expr, size_t exprsz, const char *column, const char *text)
+{
+	size_t len = strlen(expr);
+
+	if (len + strlen(column) + 10 >= exprsz)
+		return;
+
+	len += sprintf(expr + len, "%s%s : \"", len ? " AND " : "", column);
+
+	for (; *text && len + 3 < exprsz; ++text) {
+		if (*text == '"')
+			expr[len++] = '"';
+
+		expr[len++] = *text;
+	}
+
+	expr[len++] = '"';
+	expr[len] = '\0';
+}
+
+/* Make LIKE wildcards in the text match themselves. */
+static const char *
+escape(char *dst, size_t dstsz, const char *text)
+{
+	size_t len = 0;
+
+	for (; text && *text && len + 3 < dstsz; ++text) {
+		if (*text == '%' || *text == '_' || *text == '\\')
+			dst[len++] = '\\';
+
+		dst[len++] = *text;
+	}
+
+	dst[len] = '\0';
+
+	return dst;
+}
+
+/* Number of UTF-8 characters, as trigrams are made of characters. */
+static size_t
+length(const char *s)
+{
+	size_t n = 0;
+
+	for (; *s; ++s)
+		if ((*s & 0xc0) != 0x80)
+			++n;
+
+	return n;
 }
 
 bool
 database_search(struct image *images,
                 size_t *max,
                 const char *title,
-                const char *author)
+                const char *author,
+                const struct image *before)
 {
 	assert(images);
 	assert(max);
+	assert(!before || before->id);
 
-	sqlite3_stmt *stmt = NULL;
+	char expr[BUFSIZ] = {0}, like[2][BUFSIZ];
+	sqlite3_stmt *stmt;
 	size_t i;
+	int col = 1;
 
 	memset(images, 0, *max * sizeof (*images));
 
-	/* Select everything if not specified. */
-	title    = title    ? title    : "%";
-	author   = author   ? author   : "%";
+	/* Without criteria, the search is the same as listing recents. */
+	if (!title && !author)
+		return database_recents(images, max, before);
 
-	if (sqlite3_prepare(db, sql_search, -1, &stmt, NULL) != SQLITE_OK)
-		goto sqlite_err;
-	if (sqlite3_bind_text(stmt, 1, title, -1, NULL) != SQLITE_OK)
-		goto sqlite_err;
-	if (sqlite3_bind_text(stmt, 2, author, -1, NULL) != SQLITE_OK)
+	if ((title && length(title) < 3) || (author && length(author) < 3)) {
+		stmt = stmts[STMT_SEARCH_LIKE].handle;
+
+		escape(like[0], sizeof (like[0]), title);
+		escape(like[1], sizeof (like[1]), author);
+
+		if (sqlite3_bind_text(stmt, col++, like[0], -1, SQLITE_STATIC) != SQLITE_OK ||
+		    sqlite3_bind_text(stmt, col++, like[1], -1, SQLITE_STATIC) != SQLITE_OK)
+			goto sqlite_err;
+	} else {
+		stmt = stmts[STMT_SEARCH].handle;
+
+		if (title)
+			match(expr, sizeof (expr), "title", title);
+		if (author)
+			match(expr, sizeof (expr), "author", author);
+		if (sqlite3_bind_text(stmt, col++, expr, -1, SQLITE_STATIC) != SQLITE_OK)
+			goto sqlite_err;
+	}
+
+	if (bind_before(stmt, col, before) != SQLITE_OK)
 		goto sqlite_err;
-	if (sqlite3_bind_int64(stmt, 3, *max) != SQLITE_OK)
+	if (sqlite3_bind_int64(stmt, col + 2, *max) != SQLITE_OK)
 		goto sqlite_err;
 
 	for (i = 0; i < *max && sqlite3_step(stmt) == SQLITE_ROW; ++i)
 		convert(stmt, &images[i]);
 
 	log_debug("database: found %zu images", i);
-	sqlite3_finalize(stmt);
+	reset(stmt);
 	*max = i;
 
 	return true;
 
 sqlite_err:
-	log_warn("database: error (search): %s\n", sqlite3_errmsg(db));
-
-	if (stmt)
-		sqlite3_finalize(stmt);
+	log_warn("database: error (search): %s\n", sqlite3_errmsg(rdb));
+	reset(stmt);
 
 	return (*max = 0);
 }
@@ -386,10 +1274,115 @@ sqlite_err:
 void
 database_clear(void)
 {
+	sqlite3_stmt *stmt = stmts[STMT_CLEAR].handle;
+	sqlite3_stmt *unused = stmts[STMT_UNUSED].handle;
+	sqlite3_stmt *unused_delete = stmts[STMT_UNUSED_DELETE].handle;
+	const struct storage *backend;
+	const char *hash;
+	const time_t now = time(NULL);
+
+	if (!wdb) {
+		log_warn("database: error (clear): opened read-only");
+		return;
+	}
+
 	log_debug("database: clearing deprecated images");
 
-	if (sqlite3_exec(db, sql_clear, NULL, NULL, NULL) != SQLITE_OK)
-		log_warn("database: error (clear): %s\n", sqlite3_errmsg(db));
+	/* Reference counts are decremented by a trigger. */
+	if (sqlite3_exec(wdb, "BEGIN IMMEDIATE TRANSACTION", NULL, NULL, NULL) != SQLITE_OK)
+		goto lock_err;
+	if (sqlite3_bind_int64(stmt, 1, now) != SQLITE_OK ||
+	    sqlite3_step(stmt) != SQLITE_DONE)
+		goto sqlite_err;
+
+	log_debug("database: removed %d images", sqlite3_changes(wdb));
+	reset(stmt);
+
+	if (sqlite3_exec(wdb, "COMMIT", NULL, NULL, NULL) != SQLITE_OK)
+		goto sqlite_err;
+
+	/*
+	 * Data is only removed once no committed image refers to it, this
+	 * also sweeps data left by a previous clear interrupted here. The
+	 * write lock keeps new images from referring to it meanwhile and
+	 * data removed before a failed commit is unused anyway.
+	 */
+	if (sqlite3_exec(wdb, "BEGIN IMMEDIATE TRANSACTION", NULL, NULL, NULL) != SQLITE_OK)
+		goto lock_err;
+
+	while (sqlite3_step(unused) == SQLITE_ROW) {
+		hash = (const char *)sqlite3_column_text(unused, 0);
+
+		if ((backend = find(hash)))
+			backend->remove(hash);
+	}
+
+	if (sqlite3_step(unused_delete) != SQLITE_DONE)
+		goto sqlite_err;
+
+	reset(unused);
+	reset(unused_delete);
+
+	if (sqlite3_exec(wdb, "COMMIT", NULL, NULL, NULL) != SQLITE_OK)
+		goto sqlite_err;
+
+	return;
+
+lock_err:
+	log_warn("database: could not lock database: %s", sqlite3_errmsg(wdb));
+	return;
+
+sqlite_err:
+	log_warn("database: error (clear): %s", sqlite3_errmsg(wdb));
+	reset(stmt);
+	reset(unused);
+	reset(unused_delete);
+	sqlite3_exec(wdb, "ROLLBACK", NULL, NULL, NULL);
+}
+
+void
+database_compact(unsigned int threshold)
+{
+	storage_pack_compact(threshold);
+}
+
+const char *
+database_explain(const char *name)
+{
+	assert(name);
+
+	static _Thread_local char plan[BUFSIZ];
+	sqlite3_stmt *stmt = NULL;
+	sqlite3 *db;
+	size_t i;
+
+	for (i = 0; i < NELEM(stmts); ++i)
+		if (strcmp(stmts[i].name, name) == 0)
+			break;
+
+	if (i == NELEM(stmts) || !stmts[i].handle)
+		return NULL;
+
+	db = sqlite3_db_handle(stmts[i].handle);
+
+	if (sqlite3_prepare_v2(db, bprintf("EXPLAIN QUERY PLAN %s",
+	    sqlite3_sql(stmts[i].handle)), -1, &stmt, NULL) != SQLITE_OK) {
+		log_warn("database: error (explain): %s", sqlite3_errmsg(db));
+		return NULL;
+	}
+
+	plan[0] = '\0';
+
+	/* Column 3 is the human readable detail of each step. */
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		strncat(plan, (const char *)sqlite3_column_text(stmt, 3),
+		    sizeof (plan) - strlen(plan) - 1);
+		strncat(plan, "\n", sizeof (plan) - strlen(plan) - 1);
+	}
+
+	sqlite3_finalize(stmt);
+
+	return plan;
 }
 
 void
@@ -397,8 +1390,18 @@ database_finish(void)
 {
 	log_debug("database: closing");
 
-	if (db) {
-		sqlite3_close(db);
-		db = NULL;
+	for (size_t i = 0; i < NELEM(storages) && storages[i]; ++i)
+		storages[i]->finish();
+
+	storage = NULL;
+
+	for (size_t i = 0; i < NELEM(stmts); ++i) {
+		sqlite3_finalize(stmts[i].handle);
+		stmts[i].handle = NULL;
 	}
+
+	/* NULL is a harmless no-op. */
+	sqlite3_close(wdb);
+	sqlite3_close(rdb);
+	wdb = rdb = NULL;
 }
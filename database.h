@@ -19,32 +19,187 @@
 #ifndef IMGUP_DATABASE_H
 #define IMGUP_DATABASE_H
 
+#include <sys/types.h>
 #include <stdbool.h>
 #include <stddef.h>
 
 struct image;
+struct storage;
+
+/**
+ * Function called by database_stream for every chunk of image data.
+ *
+ * \param data the chunk
+ * \param datasz the chunk size
+ * \param arg the user data
+ * \return false to stop streaming
+ */
+typedef bool (*database_stream_fn)(const void *, size_t, void *);
+
+/**
+ * Make an additional storage backend selectable through config.storage,
+ * only meant for unit tests and must be called before any database_open.
+ *
+ * \param backend the backend
+ */
+void
+database_register_storage(const struct storage *);
 
 bool
 database_open(const char *);
 
+/**
+ * Open the database without writing to it, neither the schema nor images
+ * can be modified. If the schema must be upgraded, the database is opened
+ * normally instead.
+ *
+ * \param path the database path
+ * \return false on errors
+ */
 bool
-database_recents(struct image *, size_t *);
+database_open_readonly(const char *);
 
+/**
+ * Fetch the most recent public images.
+ *
+ * Only metadata is loaded, image data is left NULL while datasz is set to
+ * its length.
+ *
+ * To get the next page, pass the last image of the previous one as before
+ * argument, only its timestamp and id are used.
+ *
+ * \param images the array to fill
+ * \param max the array size, updated with the number of images found
+ * \param before the image to start after (may be NULL)
+ * \return false on errors
+ */
+bool
+database_recents(struct image *, size_t *, const struct image *);
+
+/**
+ * Tell if the string is a well formed image identifier, whether such an
+ * image exists or not.
+ *
+ * \param id the identifier to check
+ * \return true if valid
+ */
+bool
+database_isid(const char *);
+
+/**
+ * Fetch an image along with its data.
+ *
+ * Only use this function when the image bytes are really needed, pages
+ * rendering metadata should use database_get_meta instead.
+ *
+ * \param image the image to fill
+ * \param id the image identifier
+ * \return false if not found or on errors
+ */
 bool
 database_get(struct image *, const char *);
 
+/**
+ * Similar to database_get but only fetch metadata, image data is left NULL
+ * while datasz is set to its length.
+ *
+ * \param image the image to fill
+ * \param id the image identifier
+ * \return false if not found or on errors
+ */
+bool
+database_get_meta(struct image *, const char *);
+
+/**
+ * Read image data in fixed size chunks directly from the storage and pass
+ * each of them to the given function, so that memory usage does not depend
+ * on the image size.
+ *
+ * Use database_get_meta first to get the image size.
+ *
+ * \param id the image identifier
+ * \param fn the function to call
+ * \param arg the user data passed to fn
+ * \return false if not found, on errors or if fn stopped
+ */
+bool
+database_stream(const char *, database_stream_fn, void *);
+
+/**
+ * Tell in which file the image data is stored so that it can be sent without
+ * being read by the process, only the fs and pack storage keep data in plain
+ * files.
+ *
+ * \param id the image identifier
+ * \param path the buffer receiving the file path
+ * \param pathsz the buffer size
+ * \param offset set to the data offset in the file
+ * \param datasz set to the data size
+ * \return false if not found or not stored in a file
+ */
+bool
+database_locate(const char *, char *, size_t, off_t *, size_t *);
+
 bool
 database_insert(struct image *);
 
+/**
+ * Insert several images in a single transaction, which is much cheaper than
+ * one transaction per image. An image failing does not prevent the others
+ * from being inserted, its id is left NULL.
+ *
+ * \param images the images to insert
+ * \param imagesz the number of images
+ * \return the number of images inserted
+ */
+size_t
+database_insert_all(struct image *, size_t);
+
+/**
+ * Search public images whose title and author contain the given text, case
+ * insensitively. Any of them may be NULL to match everything.
+ *
+ * As with database_recents, image data is not loaded and results are
+ * paginated from the before argument.
+ *
+ * \param images the array to fill
+ * \param max the array size, updated with the number of images found
+ * \param title the title pattern (may be NULL)
+ * \param author the author pattern (may be NULL)
+ * \param before the image to start after (may be NULL)
+ * \return false on errors
+ */
 bool
 database_search(struct image *,
                 size_t *,
                 const char *,
-                const char *);
+                const char *,
+                const struct image *);
 
 void
 database_clear(void);
 
+/**
+ * Rewrite the pack files in which at least the given percentage of bytes
+ * belongs to removed images, pack files left without images are removed.
+ *
+ * \param threshold the percentage of unused bytes
+ */
+void
+database_compact(unsigned int);
+
+/**
+ * Describe how the internal query with the given name (e.g. "recents") is
+ * executed, as the EXPLAIN QUERY PLAN details separated by newlines.
+ *
+ * This is mostly meant for unit tests to make sure indexes are used.
+ *
+ * \param name the query name
+ * \return the plan in a static buffer or NULL on errors
+ */
+const char *
+database_explain(const char *);
+
 void
 database_finish(void);
 
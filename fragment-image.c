@@ -48,6 +48,7 @@ template(size_t keyword, void *arg)
 {
 	struct template *tp = arg;
 	struct khtmlreq html;
+	struct tm tm;
 
 	khtml_open(&html, tp->req, KHTML_PRETTY);
 
@@ -62,10 +63,10 @@ template(size_t keyword, void *arg)
 		khtml_puts(&html, tp->image->author);
 		break;
 	case 3:
-		khtml_puts(&html, bstrftime("%c", localtime(&tp->image->timestamp)));
+		khtml_puts(&html, bstrftime("%c", localtime_r(&tp->image->timestamp, &tm)));
 		break;
 	case 4:
-		khtml_puts(&html, ttl(tp->image->timestamp, tp->image->duration));
+		khtml_puts(&html, ttl(tp->image->expires));
 		break;
 	default:
 		break;
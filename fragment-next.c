@@ -0,0 +1,79 @@
+/*
+ * fragment-next.c -- next page link renderer
+ *
+ * Copyright (c) 2020-2023 David Demelier <markand@malikania.fr>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include <kcgi.h>
+#include <kcgihtml.h>
+
+#include "fragment-next.h"
+#include "fragment.h"
+#include "util.h"
+
+struct template {
+	struct kreq *req;
+	const char *url;
+};
+
+static const char *keywords[] = {
+	"next"
+};
+
+static int
+template(size_t keyword, void *arg)
+{
+	struct template *t = arg;
+	struct khtmlreq html;
+
+	khtml_open(&html, t->req, KHTML_PRETTY);
+
+	switch (keyword) {
+	case 0:
+		khtml_puts(&html, t->url);
+		break;
+	default:
+		break;
+	}
+
+	khtml_close(&html);
+
+	return 1;
+}
+
+void
+fragment_next(struct kreq *r, const char *url)
+{
+	assert(r);
+	assert(url);
+
+	struct template data = {
+		.req = r,
+		.url = url
+	};
+	struct ktemplate kt = {
+		.key = keywords,
+		.keysz = NELEM(keywords),
+		.cb = template,
+		.arg = &data
+	};
+
+	fragment(r, &kt, "fragments/next.html");
+}
@@ -17,15 +17,21 @@
  */
 
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
 #include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <kcgi.h>
@@ -87,19 +93,329 @@ process(struct kreq *req)
 		handlers[req->page](req);
 }
 
-void
-http_fcgi_run(void)
+/*
+ * In CGI mode the database is opened for every request, only uploads need
+ * to write to it unless they are handed to imgupd-writer and static files
+ * don't need it at all. Other requests don't take any lock and run
+ * concurrently.
+ */
+static bool
+prepare(const struct kreq *req)
 {
-	struct kreq req;
+	if (req->page == PAGE_STATIC)
+		return true;
+	if (req->page == PAGE_NEW && req->method == KMETHOD_POST && !config.writer[0])
+		return database_open(config.databasepath);
+
+	return database_open_readonly(config.databasepath);
+}
+
+struct worker {
 	struct kfcgi *fcgi;
+	pthread_t thread;
+	bool pooled;
+};
 
-	if (khttp_fcgi_init(&fcgi, NULL, 0, pages, PAGE_NUM, 0) != KCGI_OK)
-		return;
+/*
+ * A pooled process is recycled as a whole, its threads share the number of
+ * requests served and the memory used.
+ */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct worker *workers;
+static unsigned int nworkers;
+static unsigned long served;
+static bool recycling;
+
+/*
+ * Tell if a worker has to be replaced by a fresh one, any leak or memory
+ * fragmentation is then bounded.
+ */
+static bool
+recycle(void)
+{
+	struct rusage usage;
+
+	if (config.maxrequests && served >= config.maxrequests) {
+		log_info("http: worker served %lu requests, recycling", served);
+		return true;
+	}
+
+	/* The peak resident set size of the whole process, in KiB. */
+	if (config.maxrss && getrusage(RUSAGE_SELF, &usage) == 0 &&
+	    usage.ru_maxrss >= config.maxrss) {
+		log_info("http: worker reached %ld KiB, recycling", (long)usage.ru_maxrss);
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Count a request served and tell if the thread must stop. The first thread
+ * to notice cancels the other ones, those serving a request finish it as
+ * cancellation is only enabled while waiting for the next one.
+ */
+static bool
+retire(const struct worker *w)
+{
+	bool ret;
+
+	pthread_mutex_lock(&mutex);
+	++served;
+
+	if (!recycling && recycle()) {
+		recycling = true;
+
+		for (unsigned int i = 0; config.threads && i < nworkers; ++i)
+			if (&workers[i] != w)
+				pthread_cancel(workers[i].thread);
+	}
+
+	ret = recycling;
+	pthread_mutex_unlock(&mutex);
+
+	return ret;
+}
+
+static void
+finish(void *data)
+{
+	(void)data;
+
+	database_finish();
+}
+
+static void *
+loop(void *data)
+{
+	struct worker *w = data;
+	struct kreq req;
+	enum kcgi_err err;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	/* Long lived, opened once for every request of this thread. */
+	if (config.writer[0] && !database_open_readonly(config.databasepath))
+		die("abort: could not open database\n");
+	if (!config.writer[0] && !database_open(config.databasepath))
+		die("abort: could not open database\n");
+
+	pthread_cleanup_push(finish, NULL);
+
+	for (;;) {
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		err = khttp_fcgi_parse(w->fcgi, &req);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		if (err != KCGI_OK)
+			break;
 
-	while (khttp_fcgi_parse(fcgi, &req) == KCGI_OK)
 		process(&req);
 
-	khttp_fcgi_free(fcgi);
+		if (w->pooled && retire(w))
+			break;
+	}
+
+	pthread_cleanup_pop(1);
+
+	return NULL;
+}
+
+/*
+ * With config.threads, every thread has its own kcgi context and database
+ * connections while sharing the process memory. The contexts are created
+ * before starting any thread as kcgi forks its helper processes.
+ */
+static void
+serve(bool pooled)
+{
+	unsigned int n = config.threads ? config.threads : 1;
+
+	if (!(workers = calloc(n, sizeof (*workers))))
+		die("abort: %s\n", strerror(errno));
+
+	for (unsigned int i = 0; i < n; ++i) {
+		if (khttp_fcgi_init(&workers[i].fcgi, NULL, 0, pages, PAGE_NUM, 0) != KCGI_OK) {
+			n = i;
+			break;
+		}
+
+		workers[i].pooled = pooled;
+	}
+
+	nworkers = n;
+
+	if (!config.threads && n)
+		loop(&workers[0]);
+	else {
+		log_info("http: starting %u threads", n);
+
+		/* Every thread must exist before one can cancel the others. */
+		pthread_mutex_lock(&mutex);
+
+		for (unsigned int i = 0; i < n; ++i)
+			if ((errno = pthread_create(&workers[i].thread, NULL, loop, &workers[i])))
+				die("abort: %s\n", strerror(errno));
+
+		pthread_mutex_unlock(&mutex);
+
+		for (unsigned int i = 0; i < n; ++i)
+			pthread_join(workers[i].thread, NULL);
+	}
+
+	for (unsigned int i = 0; i < n; ++i)
+		khttp_fcgi_free(workers[i].fcgi);
+
+	free(workers);
+	workers = NULL;
+	nworkers = 0;
+}
+
+static volatile sig_atomic_t running;
+
+static void
+stop(int sig)
+{
+	(void)sig;
+
+	running = 0;
+}
+
+/* Only wakes sigsuspend up, children are reaped in pool. */
+static void
+reap(int sig)
+{
+	(void)sig;
+}
+
+static pid_t
+spawn(const sigset_t *mask)
+{
+	pid_t pid;
+
+	switch ((pid = fork())) {
+	case -1:
+		log_warn("http: fork: %s", strerror(errno));
+		break;
+	case 0:
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGCHLD, SIG_DFL);
+		sigprocmask(SIG_SETMASK, mask, NULL);
+		serve(true);
+		database_finish();
+		log_finish();
+		exit(0);
+	default:
+		break;
+	}
+
+	return pid;
+}
+
+/*
+ * Keep config.workers processes accepting on the FastCGI socket inherited
+ * from the spawner, so that a slow client only holds one of them. Each
+ * worker opens its own database and kcgi context after the fork.
+ */
+static void
+pool(void)
+{
+	struct sigaction sa = {0};
+	sigset_t blocked, mask;
+	pid_t *pids, pid;
+	time_t *started;
+	unsigned int alive = 0;
+	bool stopping = false;
+	int status;
+
+	if (!(pids = calloc(config.workers, sizeof (*pids))) ||
+	    !(started = calloc(config.workers, sizeof (*started))))
+		die("abort: %s\n", strerror(errno));
+
+	/*
+	 * The signals are only delivered while waiting in sigsuspend so that
+	 * none is missed between checking running and waiting.
+	 */
+	sigemptyset(&blocked);
+	sigaddset(&blocked, SIGINT);
+	sigaddset(&blocked, SIGTERM);
+	sigaddset(&blocked, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &blocked, &mask);
+
+	sa.sa_handler = stop;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = reap;
+	sigaction(SIGCHLD, &sa, NULL);
+
+	log_info("http: starting %u workers", config.workers);
+
+	for (running = 1; ; ) {
+		for (unsigned int i = 0; running && i < config.workers; ++i) {
+			if (pids[i])
+				continue;
+
+			/* Don't spin if workers can't even start. */
+			if (started[i] == time(NULL))
+				sleep(1);
+
+			started[i] = time(NULL);
+
+			if ((pids[i] = spawn(&mask)) > 0)
+				alive++;
+			else
+				pids[i] = 0;
+		}
+
+		/* Forward the signal once, then wait for every worker. */
+		if (!running && !stopping) {
+			for (unsigned int i = 0; i < config.workers; ++i)
+				if (pids[i])
+					kill(pids[i], SIGTERM);
+
+			stopping = true;
+		}
+
+		if (stopping && !alive)
+			break;
+		if ((pid = waitpid(-1, &status, WNOHANG)) == 0) {
+			sigsuspend(&mask);
+			continue;
+		}
+		if (pid < 0) {
+			if (errno == EINTR || errno == ECHILD)
+				continue;
+
+			log_warn("http: waitpid: %s", strerror(errno));
+			break;
+		}
+
+		for (unsigned int i = 0; i < config.workers; ++i) {
+			if (pids[i] != pid)
+				continue;
+
+			if (WIFSIGNALED(status))
+				log_warn("http: worker %ld killed by signal %d", (long)pid, WTERMSIG(status));
+
+			pids[i] = 0;
+			alive--;
+		}
+	}
+
+	sigprocmask(SIG_SETMASK, &mask, NULL);
+	free(pids);
+	free(started);
+}
+
+void
+http_fcgi_run(void)
+{
+	if (config.workers)
+		pool();
+	else
+		serve(false);
 }
 
 void
@@ -107,6 +423,12 @@ http_cgi_run(void)
 {
 	struct kreq req;
 
-	if (khttp_parse(&req, NULL, 0, pages, PAGE_NUM, 0) == KCGI_OK)
+	if (khttp_parse(&req, NULL, 0, pages, PAGE_NUM, 0) != KCGI_OK)
+		return;
+
+	if (!prepare(&req)) {
+		log_warn("http: unable to open database");
+		page(&req, NULL, KHTTP_500, "pages/500.html", "500");
+	} else
 		process(&req);
 }
@@ -0,0 +1,1044 @@
+/*
+ * httpd.c -- standalone HTTP server
+ *
+ * Copyright (c) 2020-2023 David Demelier <markand@malikania.fr>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+#include <netinet/in.h>
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "database.h"
+#include "http.h"
+#include "httpd.h"
+#include "log.h"
+#include "util.h"
+
+extern char **environ;
+
+enum state {
+	STATE_READ,     /* Waiting for a complete request. */
+	STATE_RUN,      /* Relaying the response. */
+	STATE_CLOSE     /* To be removed. */
+};
+
+struct buf {
+	char *data;
+	size_t size;
+	size_t cap;
+	size_t off;
+};
+
+struct conn {
+	enum state state;
+	int fd;
+	int in;                 /* Child standard input, -1 if closed. */
+	int out;                /* Child standard output, -1 if closed. */
+	time_t last;
+	char addr[INET6_ADDRSTRLEN];
+
+	/*
+	 * Request head until the child starts, then the part of the body not
+	 * yet given to it, possibly followed by the next request.
+	 */
+	struct buf req;
+	size_t headsz;
+	size_t bodysz;          /* Body bytes left to give to the child. */
+	bool http11;
+	bool keepalive;
+	bool nobody;
+
+	/* CGI head until complete, then the response for the client. */
+	struct buf cgi;
+	struct buf res;
+	bool started;
+	bool chunked;
+	bool eof;
+
+	/* File sent after the response head, see page-download.c. */
+	int file;
+	off_t fileoff;
+	off_t filesz;
+};
+
+static struct conn *conns[HTTPD_CONN_MAX];
+static size_t connsz;
+static int sock = -1;
+static char host[256];
+static char port[32];
+
+static void
+append(struct buf *b, const void *data, size_t datasz)
+{
+	if (b->size + datasz > b->cap) {
+		b->cap = b->size + datasz < BUFSIZ ? BUFSIZ : (b->size + datasz) * 2;
+
+		if (!(b->data = realloc(b->data, b->cap)))
+			die("abort: %s\n", strerror(errno));
+	}
+
+	memcpy(b->data + b->size, data, datasz);
+	b->size += datasz;
+}
+
+static void
+appendf(struct buf *b, const char *fmt, ...)
+{
+	char line[BUFSIZ];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(line, sizeof (line), fmt, ap);
+	va_end(ap);
+
+	if (len > 0)
+		append(b, line, (size_t)len < sizeof (line) ? (size_t)len : sizeof (line) - 1);
+}
+
+/* Remove the first bytes, used once they have been consumed. */
+static void
+consume(struct buf *b, size_t n)
+{
+	memmove(b->data, b->data + n, b->size - n);
+	b->size -= n;
+	b->off = 0;
+}
+
+static void
+release(struct buf *b)
+{
+	free(b->data);
+	memset(b, 0, sizeof (*b));
+}
+
+/* Find the empty line ending a head, either with CRLF or LF alone. */
+static size_t
+headlen(const char *data, size_t datasz)
+{
+	for (size_t i = 0; i + 1 < datasz; ++i) {
+		if (data[i] != '\n')
+			continue;
+		if (data[i + 1] == '\n')
+			return i + 2;
+		if (data[i + 1] == '\r' && i + 2 < datasz && data[i + 2] == '\n')
+			return i + 3;
+	}
+
+	return 0;
+}
+
+/*
+ * Iterate over the header lines of a NUL terminated head, the line is split
+ * in place into its name and value.
+ */
+static bool
+header(char **p, char **name, char **value)
+{
+	char *line, *end, *sep;
+
+	while (**p) {
+		line = *p;
+
+		if ((end = strchr(line, '\n'))) {
+			*p = end + 1;
+
+			if (end > line && end[-1] == '\r')
+				--end;
+
+			*end = '\0';
+		} else
+			*p = line + strlen(line);
+
+		if (!(sep = strchr(line, ':')))
+			continue;
+
+		*sep++ = '\0';
+
+		while (*sep == ' ' || *sep == '\t')
+			sep++;
+
+		*name = line;
+		*value = sep;
+
+		return true;
+	}
+
+	return false;
+}
+
+static void
+fail(struct conn *c, const char *status)
+{
+	log_debug("httpd: %s: %s", c->addr, status);
+
+	c->state = STATE_RUN;
+	c->keepalive = false;
+	c->eof = true;
+	appendf(&c->res, "HTTP/1.1 %s\r\n"
+	                 "Content-Length: 0\r\n"
+	                 "Connection: close\r\n\r\n", status);
+}
+
+/*
+ * Check the request line and the headers needed by the server itself, the
+ * other ones are only converted for the child.
+ */
+static bool
+scan(struct conn *c)
+{
+	char head[HTTPD_HEAD_MAX + 1], *p, *name, *value, *end;
+	char method[16], target[HTTPD_HEAD_MAX], version[16];
+	long long length = 0;
+	bool close = false, keep = false, expect = false, sized = false;
+
+	memcpy(head, c->req.data, c->headsz);
+	head[c->headsz] = '\0';
+
+	if (sscanf(head, "%15s %16383s %15s", method, target, version) != 3 ||
+	    target[0] != '/' || strncmp(version, "HTTP/1.", 7) != 0) {
+		fail(c, "400 Bad Request");
+		return false;
+	}
+
+	c->http11 = strcmp(version, "HTTP/1.0") != 0;
+	c->nobody = strcmp(method, "HEAD") == 0;
+	p = strchr(head, '\n') + 1;
+
+	while (header(&p, &name, &value)) {
+		if (strcasecmp(name, "Content-Length") == 0) {
+			errno = 0;
+			length = strtoll(value, &end, 10);
+
+			/* A second one could be read differently by the child. */
+			if (sized || end == value || *end || errno == ERANGE ||
+			    length < 0) {
+				fail(c, "400 Bad Request");
+				return false;
+			}
+
+			sized = true;
+		} else if (strcasecmp(name, "Transfer-Encoding") == 0) {
+			fail(c, "411 Length Required");
+			return false;
+		} else if (strcasecmp(name, "Connection") == 0) {
+			close = strcasecmp(value, "close") == 0;
+			keep = strcasecmp(value, "keep-alive") == 0;
+		} else if (strcasecmp(name, "Expect") == 0)
+			expect = strcasecmp(value, "100-continue") == 0;
+	}
+
+	if (length > HTTPD_BODY_MAX) {
+		fail(c, "413 Payload Too Large");
+		return false;
+	}
+
+	c->bodysz = length;
+	c->keepalive = c->http11 ? !close : keep;
+
+	if (expect && c->http11 && c->req.size < c->headsz + c->bodysz)
+		appendf(&c->res, "HTTP/1.1 100 Continue\r\n\r\n");
+
+	return true;
+}
+
+static void
+setenvf(char ***env, size_t *envsz, const char *fmt, ...)
+{
+	char line[HTTPD_HEAD_MAX];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(line, sizeof (line), fmt, ap);
+	va_end(ap);
+
+	if (!(*env = realloc(*env, (*envsz + 2) * sizeof (**env))))
+		die("abort: %s\n", strerror(errno));
+
+	(*env)[(*envsz)++] = estrdup(line);
+	(*env)[*envsz] = NULL;
+}
+
+/*
+ * Build the CGI environment as a web server would, every header becomes a
+ * HTTP_ variable. Only called in the child.
+ */
+static char **
+cgienv(struct conn *c)
+{
+	char head[HTTPD_HEAD_MAX + 1], *p, *name, *value, *query;
+	char method[16], target[HTTPD_HEAD_MAX], version[16];
+	char **env = NULL;
+	size_t envsz = 0;
+
+	memcpy(head, c->req.data, c->headsz);
+	head[c->headsz] = '\0';
+	sscanf(head, "%15s %16383s %15s", method, target, version);
+
+	setenvf(&env, &envsz, "GATEWAY_INTERFACE=CGI/1.1");
+	setenvf(&env, &envsz, "SERVER_SOFTWARE=imgupd");
+	setenvf(&env, &envsz, "SERVER_NAME=%s", host[0] ? host : "localhost");
+	setenvf(&env, &envsz, "SERVER_PORT=%s", port);
+	setenvf(&env, &envsz, "SERVER_PROTOCOL=%s", version);
+	setenvf(&env, &envsz, "REMOTE_ADDR=%s", c->addr);
+	setenvf(&env, &envsz, "REQUEST_METHOD=%s", method);
+	setenvf(&env, &envsz, "REQUEST_URI=%s", target);
+	setenvf(&env, &envsz, "SCRIPT_NAME=");
+
+	if ((query = strchr(target, '?')))
+		*query++ = '\0';
+
+	setenvf(&env, &envsz, "PATH_INFO=%s", target);
+	setenvf(&env, &envsz, "QUERY_STRING=%s", query ? query : "");
+	p = strchr(head, '\n') + 1;
+
+	/* The length checked by scan, whatever the client sent. */
+	if (c->bodysz)
+		setenvf(&env, &envsz, "CONTENT_LENGTH=%zu", c->bodysz);
+
+	while (header(&p, &name, &value)) {
+		/* Content_Length would otherwise pass for Content-Length. */
+		if (strchr(name, '_'))
+			continue;
+
+		for (char *s = name; *s; ++s)
+			*s = *s == '-' ? '_' : toupper((unsigned char)*s);
+
+		if (strcmp(name, "CONTENT_LENGTH") == 0)
+			continue;
+		if (strcmp(name, "CONTENT_TYPE") == 0)
+			setenvf(&env, &envsz, "%s=%s", name, value);
+		else
+			setenvf(&env, &envsz, "HTTP_%s=%s", name, value);
+	}
+
+	return env;
+}
+
+static void
+child(struct conn *c, int in, int out)
+{
+	/* Only keep the pipes of this request. */
+	close(sock);
+
+	for (size_t i = 0; i < connsz; ++i) {
+		close(conns[i]->fd);
+
+		if (conns[i]->in >= 0)
+			close(conns[i]->in);
+		if (conns[i]->out >= 0)
+			close(conns[i]->out);
+		if (conns[i]->file >= 0)
+			close(conns[i]->file);
+	}
+
+	if (dup2(in, STDIN_FILENO) < 0 || dup2(out, STDOUT_FILENO) < 0)
+		exit(1);
+
+	close(in);
+	close(out);
+	signal(SIGPIPE, SIG_DFL);
+
+	environ = cgienv(c);
+	http_cgi_run();
+	database_finish();
+	exit(0);
+}
+
+static void
+run(struct conn *c)
+{
+	int in[2] = { -1, -1 }, out[2] = { -1, -1 };
+
+	if (pipe(in) < 0 || pipe(out) < 0)
+		goto err;
+
+	switch (fork()) {
+	case -1:
+		goto err;
+	case 0:
+		close(in[1]);
+		close(out[0]);
+		child(c, in[0], out[1]);
+		break;
+	default:
+		break;
+	}
+
+	close(in[0]);
+	close(out[1]);
+	consume(&c->req, c->headsz);
+	c->state = STATE_RUN;
+	c->in = in[1];
+	c->out = out[0];
+	fcntl(c->in, F_SETFL, O_NONBLOCK);
+	fcntl(c->out, F_SETFL, O_NONBLOCK);
+
+	if (c->bodysz == 0) {
+		close(c->in);
+		c->in = -1;
+	}
+
+	return;
+
+err:
+	log_warn("httpd: %s", strerror(errno));
+
+	for (int i = 0; i < 2; ++i) {
+		if (in[i] >= 0)
+			close(in[i]);
+		if (out[i] >= 0)
+			close(out[i]);
+	}
+
+	fail(c, "503 Service Unavailable");
+}
+
+/*
+ * Start the request as soon as its head is complete, the body is then given
+ * to the child as it arrives.
+ */
+static void
+advance(struct conn *c)
+{
+	if (c->state != STATE_READ)
+		return;
+
+	if (!c->headsz) {
+		if (!(c->headsz = headlen(c->req.data, c->req.size))) {
+			if (c->req.size > HTTPD_HEAD_MAX)
+				fail(c, "431 Request Header Fields Too Large");
+
+			return;
+		}
+		if (c->headsz > HTTPD_HEAD_MAX) {
+			fail(c, "431 Request Header Fields Too Large");
+			return;
+		}
+		if (!scan(c))
+			return;
+	}
+
+	run(c);
+}
+
+/* Decode the percent-encoded path in place. */
+static void
+unescape(char *path)
+{
+	char *dst = path;
+	unsigned int c;
+
+	for (; *path; ++path) {
+		if (*path == '%' && sscanf(path + 1, "%2x", &c) == 1) {
+			*dst++ = c;
+			path += 2;
+		} else
+			*dst++ = *path;
+	}
+
+	*dst = '\0';
+}
+
+/*
+ * The child asks for a part of a file to be sent with X-Sendfile2, given as
+ * the encoded path followed by the inclusive byte range.
+ */
+static bool
+attach(struct conn *c, char *value)
+{
+	struct stat st;
+	long long first, last;
+	char *range;
+
+	if (!(range = strrchr(value, ' ')) ||
+	    sscanf(range + 1, "%lld-%lld", &first, &last) != 2 || first < 0 || last < first)
+		return false;
+
+	*range = '\0';
+	unescape(value);
+
+	if ((c->file = open(value, O_RDONLY)) < 0 || fstat(c->file, &st) < 0)
+		goto err;
+	if (st.st_size <= last) {
+		errno = ERANGE;
+		goto err;
+	}
+
+	c->fileoff = first;
+	c->filesz = last - first + 1;
+
+	return true;
+
+err:
+	log_warn("httpd: unable to send %s: %s", value, strerror(errno));
+
+	if (c->file >= 0) {
+		close(c->file);
+		c->file = -1;
+	}
+
+	return false;
+}
+
+/*
+ * Convert the CGI head into the response head, the Status header becomes
+ * the status line and the body is chunked if its length is unknown.
+ */
+static bool
+start(struct conn *c, size_t headsz)
+{
+	char head[HTTPD_HEAD_MAX + 1], *p, *name, *value;
+	char status[64] = "200 OK";
+	bool length = false;
+	int code;
+
+	if (headsz > HTTPD_HEAD_MAX)
+		return false;
+
+	memcpy(head, c->cgi.data, headsz);
+	head[headsz] = '\0';
+	p = head;
+
+	/* First pass for the status line. */
+	while (header(&p, &name, &value)) {
+		if (strcasecmp(name, "Status") == 0)
+			snprintf(status, sizeof (status), "%s", value);
+		else if (strcasecmp(name, "Location") == 0 && strcmp(status, "200 OK") == 0)
+			snprintf(status, sizeof (status), "302 Found");
+		else if (strcasecmp(name, "X-Sendfile2") == 0 && !attach(c, value))
+			return false;
+	}
+
+	code = atoi(status);
+	appendf(&c->res, "HTTP/1.1 %s\r\n", status);
+
+	if (code / 100 == 1 || code == 204 || code == 304)
+		c->nobody = true;
+
+	memcpy(head, c->cgi.data, headsz);
+	head[headsz] = '\0';
+	p = head;
+
+	while (header(&p, &name, &value)) {
+		if (strcasecmp(name, "Status") == 0 ||
+		    strcasecmp(name, "Connection") == 0 ||
+		    strcasecmp(name, "Transfer-Encoding") == 0 ||
+		    strcasecmp(name, "X-Sendfile2") == 0)
+			continue;
+		if (strcasecmp(name, "Content-Length") == 0) {
+			if (c->file >= 0)
+				continue;
+
+			length = true;
+		}
+
+		appendf(&c->res, "%s: %s\r\n", name, value);
+	}
+
+	if (c->file >= 0) {
+		appendf(&c->res, "Content-Length: %lld\r\n", (long long)c->filesz);
+		length = true;
+
+		if (c->nobody) {
+			close(c->file);
+			c->file = -1;
+		}
+	}
+
+	if (!length && !c->nobody) {
+		if (c->http11) {
+			c->chunked = true;
+			appendf(&c->res, "Transfer-Encoding: chunked\r\n");
+		} else
+			c->keepalive = false;
+	}
+
+	appendf(&c->res, "Connection: %s\r\n\r\n", c->keepalive ? "keep-alive" : "close");
+	c->started = true;
+
+	return true;
+}
+
+static void
+body(struct conn *c, const char *data, size_t datasz)
+{
+	if (c->nobody || c->file >= 0 || !datasz)
+		return;
+
+	if (c->chunked) {
+		appendf(&c->res, "%zx\r\n", datasz);
+		append(&c->res, data, datasz);
+		append(&c->res, "\r\n", 2);
+	} else
+		append(&c->res, data, datasz);
+}
+
+static void
+feed(struct conn *c, const char *data, size_t datasz)
+{
+	size_t headsz;
+
+	if (c->started) {
+		body(c, data, datasz);
+		return;
+	}
+
+	append(&c->cgi, data, datasz);
+
+	if (!(headsz = headlen(c->cgi.data, c->cgi.size))) {
+		if (c->cgi.size > HTTPD_HEAD_MAX)
+			goto err;
+
+		return;
+	}
+
+	if (!start(c, headsz))
+		goto err;
+
+	body(c, c->cgi.data + headsz, c->cgi.size - headsz);
+	release(&c->cgi);
+
+	return;
+
+err:
+	close(c->out);
+	c->out = -1;
+	release(&c->res);
+	fail(c, "502 Bad Gateway");
+}
+
+static void
+finish(struct conn *c)
+{
+	close(c->out);
+	c->out = -1;
+	c->eof = true;
+
+	if (!c->started) {
+		release(&c->res);
+		fail(c, "502 Bad Gateway");
+	} else if (c->chunked)
+		append(&c->res, "0\r\n\r\n", 5);
+}
+
+/* Prepare for the next request, which may already be buffered. */
+static void
+reset(struct conn *c)
+{
+	if (c->in >= 0)
+		close(c->in);
+	if (c->out >= 0)
+		close(c->out);
+	if (c->file >= 0)
+		close(c->file);
+
+	release(&c->cgi);
+	release(&c->res);
+
+	c->state = STATE_READ;
+	c->in = c->out = c->file = -1;
+	c->headsz = c->bodysz = 0;
+	c->started = c->chunked = c->eof = c->nobody = false;
+
+	advance(c);
+}
+
+/* Once the child exited and its output has been sent. */
+static void
+complete(struct conn *c)
+{
+	if (c->state != STATE_RUN || !c->eof || c->res.size || c->file >= 0 ||
+	    c->bodysz)
+		return;
+
+	if (c->keepalive)
+		reset(c);
+	else
+		c->state = STATE_CLOSE;
+}
+
+/* Drop the body the child doesn't read anymore, as it arrives. */
+static void
+discard(struct conn *c)
+{
+	size_t n = c->req.size < c->bodysz ? c->req.size : c->bodysz;
+
+	consume(&c->req, n);
+	c->bodysz -= n;
+	complete(c);
+}
+
+static void
+on_client_read(struct conn *c)
+{
+	char buf[BUFSIZ];
+	ssize_t nr;
+
+	if ((nr = recv(c->fd, buf, sizeof (buf), 0)) < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			c->state = STATE_CLOSE;
+
+		return;
+	}
+	if (nr == 0) {
+		c->state = STATE_CLOSE;
+		return;
+	}
+
+	append(&c->req, buf, nr);
+
+	if (c->state == STATE_READ)
+		advance(c);
+	else if (c->in < 0)
+		discard(c);
+}
+
+/* Send the file without copying it to the process where supported. */
+static ssize_t
+transfer(struct conn *c)
+{
+#if defined(__linux__)
+	return sendfile(c->fd, c->file, &c->fileoff, c->filesz);
+#else
+	char buf[HTTPD_BUF_MAX];
+	ssize_t nr, nw;
+
+	if ((nr = pread(c->file, buf, c->filesz < HTTPD_BUF_MAX ? c->filesz : HTTPD_BUF_MAX, c->fileoff)) <= 0)
+		return nr;
+	if ((nw = send(c->fd, buf, nr, MSG_NOSIGNAL)) > 0)
+		c->fileoff += nw;
+
+	return nw;
+#endif
+}
+
+static void
+on_client_write(struct conn *c)
+{
+	ssize_t nw;
+
+	if (c->res.size)
+		nw = send(c->fd, c->res.data + c->res.off, c->res.size - c->res.off, MSG_NOSIGNAL);
+	else
+		nw = transfer(c);
+
+	if (nw < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			c->state = STATE_CLOSE;
+
+		return;
+	}
+
+	if (c->res.size) {
+		if ((c->res.off += nw) == c->res.size)
+			c->res.off = c->res.size = 0;
+	} else if (nw == 0) {
+		/* Truncated meanwhile, the length is already sent. */
+		c->state = STATE_CLOSE;
+		return;
+	} else if ((c->filesz -= nw) == 0) {
+		close(c->file);
+		c->file = -1;
+	}
+
+	complete(c);
+}
+
+static void
+on_child_write(struct conn *c)
+{
+	size_t n = c->req.size < c->bodysz ? c->req.size : c->bodysz;
+	ssize_t nw;
+
+	if ((nw = write(c->in, c->req.data, n)) < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+
+		/* The child stopped reading, it will answer anyway. */
+		close(c->in);
+		c->in = -1;
+		discard(c);
+		return;
+	}
+
+	consume(&c->req, nw);
+
+	if ((c->bodysz -= nw) == 0) {
+		close(c->in);
+		c->in = -1;
+	}
+}
+
+static void
+on_child_read(struct conn *c)
+{
+	char buf[16384];
+	ssize_t nr;
+
+	if ((nr = read(c->out, buf, sizeof (buf))) < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+
+		nr = 0;
+	}
+
+	if (nr == 0) {
+		finish(c);
+		complete(c);
+	} else
+		feed(c, buf, nr);
+}
+
+static void
+destroy(struct conn *c)
+{
+	log_debug("httpd: %s: closing", c->addr);
+
+	close(c->fd);
+
+	if (c->in >= 0)
+		close(c->in);
+	if (c->out >= 0)
+		close(c->out);
+	if (c->file >= 0)
+		close(c->file);
+
+	release(&c->req);
+	release(&c->cgi);
+	release(&c->res);
+	free(c);
+}
+
+static void
+accept_all(void)
+{
+	struct sockaddr_storage ss;
+	socklen_t sslen;
+	struct conn *c;
+	int fd;
+
+	while (connsz < HTTPD_CONN_MAX) {
+		sslen = sizeof (ss);
+
+		if ((fd = accept(sock, (struct sockaddr *)&ss, &sslen)) < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				log_warn("httpd: accept: %s", strerror(errno));
+
+			return;
+		}
+
+		if (!(c = calloc(1, sizeof (*c))))
+			die("abort: %s\n", strerror(errno));
+
+		c->fd = fd;
+		c->in = c->out = c->file = -1;
+		c->last = time(NULL);
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+
+		if (getnameinfo((struct sockaddr *)&ss, sslen, c->addr, sizeof (c->addr),
+		    NULL, 0, NI_NUMERICHOST) != 0)
+			strcpy(c->addr, "unknown");
+
+		log_debug("httpd: %s: connected", c->addr);
+		conns[connsz++] = c;
+	}
+}
+
+static void
+bind_address(void)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_PASSIVE
+	}, *res, *ai;
+	char *sep;
+	int err, on = 1;
+
+	snprintf(host, sizeof (host), "%s", config.address);
+
+	if (!(sep = strrchr(host, ':')))
+		die("abort: invalid address: %s\n", config.address);
+
+	*sep = '\0';
+	snprintf(port, sizeof (port), "%s", sep + 1);
+
+	/* [::1]:8080 and *:8080 forms. */
+	if (host[0] == '[' && (sep = strchr(host, ']'))) {
+		*sep = '\0';
+		memmove(host, host + 1, strlen(host));
+	}
+	if (strcmp(host, "*") == 0)
+		host[0] = '\0';
+
+	if ((err = getaddrinfo(host[0] ? host : NULL, port, &hints, &res)) != 0)
+		die("abort: %s: %s\n", config.address, gai_strerror(err));
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		if ((sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+			continue;
+
+		setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+
+		if (bind(sock, ai->ai_addr, ai->ai_addrlen) == 0 &&
+		    listen(sock, SOMAXCONN) == 0)
+			break;
+
+		close(sock);
+		sock = -1;
+	}
+
+	freeaddrinfo(res);
+
+	if (sock < 0)
+		die("abort: %s: %s\n", config.address, strerror(errno));
+
+	fcntl(sock, F_SETFL, O_NONBLOCK);
+}
+
+void
+httpd_run(void)
+{
+	enum { FD_CLIENT, FD_IN, FD_OUT };
+	struct pollfd fds[1 + HTTPD_CONN_MAX * 3];
+	struct { struct conn *c; int kind; } owners[1 + HTTPD_CONN_MAX * 3];
+	struct conn *c;
+	size_t n;
+	time_t now;
+	bool reading;
+
+	bind_address();
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Downloads are sent from the files by this process, whatever -x. */
+	snprintf(config.sendfile, sizeof (config.sendfile), "X-Sendfile2");
+	log_info("httpd: listening on %s", config.address);
+
+	for (;;) {
+		n = 0;
+
+		if (connsz < HTTPD_CONN_MAX)
+			fds[n++] = (struct pollfd) { .fd = sock, .events = POLLIN };
+
+		for (size_t i = 0; i < connsz; ++i) {
+			c = conns[i];
+
+			/*
+			 * Pipelined requests wait for the current response and
+			 * the body is only read as fast as the child takes it.
+			 */
+			reading = c->state == STATE_READ ||
+			    (c->bodysz && c->req.size < HTTPD_BUF_MAX);
+
+			if (reading || c->res.size || c->file >= 0) {
+				owners[n].c = c;
+				owners[n].kind = FD_CLIENT;
+				fds[n++] = (struct pollfd) {
+					.fd = c->fd,
+					.events = (reading ? POLLIN : 0) |
+					          (c->res.size || c->file >= 0 ? POLLOUT : 0)
+				};
+			}
+			if (c->in >= 0 && c->req.size) {
+				owners[n].c = c;
+				owners[n].kind = FD_IN;
+				fds[n++] = (struct pollfd) { .fd = c->in, .events = POLLOUT };
+			}
+
+			/* Slow clients make the child wait, not the server. */
+			if (c->out >= 0 && c->res.size < HTTPD_BUF_MAX) {
+				owners[n].c = c;
+				owners[n].kind = FD_OUT;
+				fds[n++] = (struct pollfd) { .fd = c->out, .events = POLLIN };
+			}
+		}
+
+		if (poll(fds, n, 1000) < 0 && errno != EINTR)
+			die("abort: poll: %s\n", strerror(errno));
+
+		now = time(NULL);
+
+		for (size_t i = 0; i < n; ++i) {
+			if (!fds[i].revents)
+				continue;
+			if (fds[i].fd == sock) {
+				accept_all();
+				continue;
+			}
+
+			c = owners[i].c;
+			c->last = now;
+
+			if (c->state == STATE_CLOSE)
+				continue;
+
+			switch (owners[i].kind) {
+			case FD_CLIENT:
+				if ((c->res.size || c->file >= 0) && (fds[i].revents & (POLLOUT | POLLERR)))
+					on_client_write(c);
+				if (fds[i].revents & (POLLIN | POLLHUP) &&
+				    (c->state == STATE_READ || c->bodysz))
+					on_client_read(c);
+				break;
+			case FD_IN:
+				if (c->in >= 0)
+					on_child_write(c);
+				break;
+			default:
+				if (c->out >= 0)
+					on_child_read(c);
+				break;
+			}
+		}
+
+		/* Children are not waited for individually. */
+		while (waitpid(-1, NULL, WNOHANG) > 0)
+			continue;
+
+		for (size_t i = 0; i < connsz; ) {
+			c = conns[i];
+
+			if (c->state != STATE_CLOSE && now - c->last < HTTPD_TIMEOUT) {
+				++i;
+				continue;
+			}
+
+			destroy(c);
+			conns[i] = conns[--connsz];
+		}
+	}
+}
@@ -0,0 +1,62 @@
+/*
+ * httpd.h -- standalone HTTP server
+ *
+ * Copyright (c) 2020-2023 David Demelier <markand@malikania.fr>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef IMGUP_HTTPD_H
+#define IMGUP_HTTPD_H
+
+/*
+ * Small HTTP/1.1 server for deployments without a web server in front. A
+ * single process multiplexes every connection, each request is run by a
+ * child process through http_cgi_run as soon as its head is received so
+ * that pages are the same in every mode. The body and the output are relayed
+ * between the client and the child without ever blocking on either.
+ */
+
+/*
+ * Maximum number of simultaneous connections, others wait in the backlog.
+ */
+#define HTTPD_CONN_MAX  256
+
+/*
+ * Maximum size of the request line and headers.
+ */
+#define HTTPD_HEAD_MAX  16384
+
+/*
+ * Maximum size of a request body.
+ */
+#define HTTPD_BODY_MAX  (64LL * 1024 * 1024)
+
+/*
+ * Bytes of request body or response kept for a connection before waiting
+ * for the other side to catch up.
+ */
+#define HTTPD_BUF_MAX   65536
+
+/*
+ * Seconds without any progress before closing a connection.
+ */
+#define HTTPD_TIMEOUT   60
+
+/**
+ * Listen on config.address, given as host:port, and serve forever.
+ */
+void
+httpd_run(void);
+
+#endif /* !IMGUP_HTTPD_H */
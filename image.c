@@ -46,6 +46,7 @@ image_finish(struct image *image)
 	free(image->author);
 	free(image->data);
 	free(image->filename);
+	free(image->hash);
 	memset(image, 0, sizeof (*image));
 }
 
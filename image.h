@@ -43,6 +43,8 @@ struct image {
 	time_t timestamp;
 	bool visible;
 	long long int duration;
+	time_t expires;
+	char *hash;
 };
 
 void
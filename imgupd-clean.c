@@ -21,32 +21,59 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+#include "config.h"
 #include "database.h"
 #include "util.h"
 
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: imgupd-clean [-d database-path]\n");
+	fprintf(stderr, "usage: imgupd-clean [-b blob-directory] [-d database-path] [-t threshold]\n");
 	exit(1);
 }
 
+/* Percentage of unused bytes, 0 would rewrite every pack on each run. */
+static unsigned int
+threshold_of(const char *value)
+{
+	char *end;
+	long n;
+
+	n = strtol(value, &end, 10);
+
+	if (!*value || *end || n < 1 || n > 100)
+		die("abort: invalid threshold: %s\n", value);
+
+	return n;
+}
+
 int
 main(int argc, char **argv)
 {
 	const char *value;
 	char path[PATH_MAX] = VARDIR "/imgup/imgup.db";
+	unsigned int threshold = 50;
 	int ch;
 
 	/* Seek environment first. */
 	if ((value = getenv("IMGUPD_DATABASE_PATH")))
 		snprintf(path, sizeof (path), "%s", value);
+	if ((value = getenv("IMGUPD_BLOB_DIR")))
+		snprintf(config.blobdir, sizeof (config.blobdir), "%s", value);
+	if ((value = getenv("IMGUPD_COMPACT_THRESHOLD")))
+		threshold = threshold_of(value);
 
-	while ((ch = getopt(argc, argv, "d:")) != -1) {
+	while ((ch = getopt(argc, argv, "b:d:t:")) != -1) {
 		switch (ch) {
+		case 'b':
+			snprintf(config.blobdir, sizeof (config.blobdir), "%s", optarg);
+			break;
 		case 'd':
 			snprintf(path, sizeof (path), "%s", optarg);
 			break;
+		case 't':
+			threshold = threshold_of(optarg);
+			break;
 		default:
 			usage();
 			break;
@@ -59,5 +86,6 @@ main(int argc, char **argv)
 		die("abort: could not open database");
 
 	database_clear();
+	database_compact(threshold);
 	database_finish();
 }
@@ -0,0 +1,109 @@
+/*
+ * imgupd-writer.c -- main imgupd-writer(8) file
+ *
+ * Copyright (c) 2020-2023 David Demelier <markand@malikania.fr>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "database.h"
+#include "log.h"
+#include "util.h"
+#include "writer.h"
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: imgupd-writer [-qv] [-b blob-directory] [-d database-path] [-S storage]\n"
+	                "                     [-s synchronous] [-W socket-path] [-w wal-autocheckpoint]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *value;
+	char sockpath[PATH_MAX] = VARDIR "/imgup/imgupd-writer.sock";
+	int ch, ret;
+
+	/* Seek environment first. */
+	if ((value = getenv("IMGUPD_DATABASE_PATH")))
+		snprintf(config.databasepath, sizeof (config.databasepath), "%s", value);
+	if ((value = getenv("IMGUPD_BLOB_DIR")))
+		snprintf(config.blobdir, sizeof (config.blobdir), "%s", value);
+	if ((value = getenv("IMGUPD_STORAGE")))
+		snprintf(config.storage, sizeof (config.storage), "%s", value);
+	if ((value = getenv("IMGUPD_SYNCHRONOUS")))
+		snprintf(config.synchronous, sizeof (config.synchronous), "%s", value);
+	if ((value = getenv("IMGUPD_VERBOSITY")))
+		config.verbosity = atoi(value);
+	if ((value = getenv("IMGUPD_WAL_AUTOCHECKPOINT")))
+		config.walautocheckpoint = estrtonum(value, 0, INT_MAX,
+		    "wal-autocheckpoint");
+	if ((value = getenv("IMGUPD_WRITER_SOCKET")))
+		snprintf(sockpath, sizeof (sockpath), "%s", value);
+
+	while ((ch = getopt(argc, argv, "b:d:qS:s:vW:w:")) != -1) {
+		switch (ch) {
+		case 'b':
+			snprintf(config.blobdir, sizeof (config.blobdir), "%s", optarg);
+			break;
+		case 'd':
+			snprintf(config.databasepath, sizeof (config.databasepath), "%s", optarg);
+			break;
+		case 'q':
+			config.verbosity = 0;
+			break;
+		case 'S':
+			snprintf(config.storage, sizeof (config.storage), "%s", optarg);
+			break;
+		case 's':
+			snprintf(config.synchronous, sizeof (config.synchronous), "%s", optarg);
+			break;
+		case 'v':
+			config.verbosity++;
+			break;
+		case 'W':
+			snprintf(sockpath, sizeof (sockpath), "%s", optarg);
+			break;
+		case 'w':
+			config.walautocheckpoint = estrtonum(optarg, 0, INT_MAX,
+			    "wal-autocheckpoint");
+			break;
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if (!config.databasepath[0])
+		die("abort: no database specified\n");
+
+	log_open();
+
+	if (!database_open(config.databasepath))
+		die("abort: could not open database\n");
+
+	ret = writer_run(sockpath) ? 0 : 1;
+
+	database_finish();
+	log_finish();
+
+	return ret;
+}
@@ -16,14 +16,15 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
 #include <unistd.h>
 
 #include "config.h"
 #include "database.h"
 #include "http.h"
+#include "httpd.h"
 #include "log.h"
 #include "util.h"
 
@@ -37,13 +38,10 @@ defaults(void)
 static void
 init(void)
 {
-	srand(time(NULL));
 	log_open();
 
 	if (!config.databasepath[0])
 		die("abort: no database specified\n");
-	if (!database_open(config.databasepath))
-		die("abort: could not open database\n");
 }
 
 static void
@@ -56,7 +54,11 @@ quit(void)
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: imgupd [-fqv] [-d database-path] [-t theme-directory]\n");
+	fprintf(stderr, "usage: imgupd [-fqv] [-b blob-directory] [-c cache-size] [-d database-path]\n"
+	                "              [-j workers] [-l address:port] [-m mmap-size] [-R max-rss]\n"
+	                "              [-r max-requests] [-S storage] [-s synchronous] [-T threads]\n"
+	                "              [-t theme-directory] [-W writer-socket] [-w wal-autocheckpoint]\n"
+	                "              [-x sendfile-header]\n");
 	exit(1);
 }
  
@@ -76,12 +78,77 @@ main(int argc, char **argv)
 		snprintf(config.themedir, sizeof (config.themedir), "%s", value);
 	if ((value = getenv("IMGUPD_VERBOSITY")))
 		config.verbosity = atoi(value);
+	if ((value = getenv("IMGUPD_BLOB_DIR")))
+		snprintf(config.blobdir, sizeof (config.blobdir), "%s", value);
+	if ((value = getenv("IMGUPD_STORAGE")))
+		snprintf(config.storage, sizeof (config.storage), "%s", value);
+	if ((value = getenv("IMGUPD_CACHE_SIZE")))
+		config.cachesize = estrtonum(value, LLONG_MIN, LLONG_MAX,
+		    "cache-size");
+	if ((value = getenv("IMGUPD_MMAP_SIZE")))
+		config.mmapsize = estrtonum(value, 0, LLONG_MAX, "mmap-size");
+	if ((value = getenv("IMGUPD_WORKERS")))
+		config.workers = estrtonum(value, 0, UINT_MAX, "workers");
+	if ((value = getenv("IMGUPD_THREADS")))
+		config.threads = estrtonum(value, 0, UINT_MAX, "threads");
+	if ((value = getenv("IMGUPD_MAX_REQUESTS")))
+		config.maxrequests = estrtonum(value, 0, LONG_MAX,
+		    "max-requests");
+	if ((value = getenv("IMGUPD_MAX_RSS")))
+		config.maxrss = estrtonum(value, 0, LONG_MAX, "max-rss");
+	if ((value = getenv("IMGUPD_SYNCHRONOUS")))
+		snprintf(config.synchronous, sizeof (config.synchronous), "%s", value);
+	if ((value = getenv("IMGUPD_WAL_AUTOCHECKPOINT")))
+		config.walautocheckpoint = estrtonum(value, 0, INT_MAX,
+		    "wal-autocheckpoint");
+	if ((value = getenv("IMGUPD_WRITER_SOCKET")))
+		snprintf(config.writer, sizeof (config.writer), "%s", value);
+	if ((value = getenv("IMGUPD_LISTEN")))
+		snprintf(config.address, sizeof (config.address), "%s", value);
+	if ((value = getenv("IMGUPD_SENDFILE")))
+		snprintf(config.sendfile, sizeof (config.sendfile), "%s", value);
 
-	while ((opt = getopt(argc, argv, "d:ft:qv")) != -1) {
+	while ((opt = getopt(argc, argv, "b:c:d:fj:l:m:R:r:S:s:T:t:qvW:w:x:")) != -1) {
 		switch (opt) {
+		case 'b':
+			snprintf(config.blobdir, sizeof (config.blobdir), "%s", optarg);
+			break;
+		case 'c':
+			config.cachesize = estrtonum(optarg, LLONG_MIN,
+			    LLONG_MAX, "cache-size");
+			break;
 		case 'd':
 			snprintf(config.databasepath, sizeof (config.databasepath), "%s", optarg);
 			break;
+		case 'j':
+			config.workers = estrtonum(optarg, 0, UINT_MAX,
+			    "workers");
+			break;
+		case 'l':
+			snprintf(config.address, sizeof (config.address), "%s", optarg);
+			break;
+		case 'm':
+			config.mmapsize = estrtonum(optarg, 0, LLONG_MAX,
+			    "mmap-size");
+			break;
+		case 'R':
+			config.maxrss = estrtonum(optarg, 0, LONG_MAX,
+			    "max-rss");
+			break;
+		case 'r':
+			config.maxrequests = estrtonum(optarg, 0, LONG_MAX,
+			    "max-requests");
+			break;
+		case 'S':
+			snprintf(config.storage, sizeof (config.storage), "%s", optarg);
+			break;
+		case 's':
+			snprintf(config.synchronous, sizeof (config.synchronous), "%s", optarg);
+			break;
+		case 'T':
+			config.threads = estrtonum(optarg, 0, UINT_MAX,
+			    "threads");
+			break;
 		case 't':
 			snprintf(config.themedir, sizeof (config.themedir), "%s", optarg);
 			break;
@@ -94,12 +161,26 @@ main(int argc, char **argv)
 		case 'q':
 			config.verbosity = 0;
 			break;
+		case 'W':
+			snprintf(config.writer, sizeof (config.writer), "%s", optarg);
+			break;
+		case 'w':
+			config.walautocheckpoint = estrtonum(optarg, 0, INT_MAX,
+			    "wal-autocheckpoint");
+			break;
+		case 'x':
+			snprintf(config.sendfile, sizeof (config.sendfile), "%s", optarg);
+			break;
 		default:
 			usage();
 			break;
 		}
 	}
 
+	/* Listening takes precedence over the CGI and FastCGI modes. */
+	if (config.address[0])
+		run = &(httpd_run);
+
 	init();
 	run();
 	quit();
@@ -17,31 +17,227 @@
  */
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <assert.h>
+#include <limits.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
 
 #include <kcgi.h>
 
+#include "config.h"
 #include "database.h"
 #include "image.h"
+#include "log.h"
 #include "page.h"
 
+static bool
+chunk(const void *data, size_t datasz, void *arg)
+{
+	return khttp_write(arg, data, datasz) == KCGI_OK;
+}
+
+/* Percent-encode a path for X-Sendfile2, which separates fields by spaces. */
+static void
+escape(char *dst, size_t dstsz, const char *path)
+{
+	size_t n = 0;
+
+	for (; *path && n + 4 < dstsz; ++path) {
+		if (strchr("/._-", *path) || (*path >= '0' && *path <= '9') ||
+		    (*path >= 'A' && *path <= 'Z') || (*path >= 'a' && *path <= 'z'))
+			dst[n++] = *path;
+		else
+			n += snprintf(dst + n, dstsz - n, "%%%02X", (unsigned char)*path);
+	}
+
+	dst[n] = '\0';
+}
+
+/*
+ * Build the header asking the front-end server to send the data itself. Only
+ * X-Sendfile2 designates a part of a file, the other headers need the data
+ * to be a whole file as with the fs storage.
+ */
+static const char *
+offload(const struct image *image, char *value, size_t valuesz)
+{
+	char path[PATH_MAX], escaped[PATH_MAX * 3];
+	struct stat st;
+	off_t offset;
+	size_t datasz, len = strlen(config.blobdir);
+
+	if (!config.sendfile[0] || !image->datasz ||
+	    !database_locate(image->id, path, sizeof (path), &offset, &datasz))
+		return NULL;
+
+	if (strcasecmp(config.sendfile, "X-Sendfile2") == 0) {
+		escape(escaped, sizeof (escaped), path);
+		snprintf(value, valuesz, "%s %lld-%lld", escaped,
+		    (long long)offset, (long long)(offset + datasz - 1));
+
+		return "X-Sendfile2";
+	}
+
+	if (offset != 0 || stat(path, &st) < 0 || (size_t)st.st_size != datasz)
+		return NULL;
+
+	/* Internal location mapped to the blob directory. */
+	if (strcasecmp(config.sendfile, "X-Accel-Redirect") == 0) {
+		if (strncmp(path, config.blobdir, len) != 0 || path[len] != '/')
+			return NULL;
+
+		snprintf(value, valuesz, "/imgup-blobs%s", path + len);
+
+		return "X-Accel-Redirect";
+	}
+
+	snprintf(value, valuesz, "%s", path);
+
+	return config.sendfile;
+}
+
+/*
+ * Tell if the If-None-Match list contains the entity tag, weak tags compare
+ * equal as required for this header.
+ */
+static bool
+match(const char *list, const char *etag)
+{
+	size_t len;
+
+	while (*list) {
+		list += strspn(list, " \t,");
+
+		if (strncmp(list, "W/", 2) == 0)
+			list += 2;
+
+		len = strcspn(list, " \t,");
+
+		if ((len == 1 && *list == '*') ||
+		    (len == strlen(etag) && strncmp(list, etag, len) == 0))
+			return true;
+
+		list += len;
+	}
+
+	return false;
+}
+
+/*
+ * Seconds since the epoch of a broken-down UTC time, timegm is not POSIX and
+ * mktime uses the local time zone.
+ */
+static long long
+utc(const struct tm *tm)
+{
+	/* Days since 1970-01-01 in a calendar starting in March. */
+	long long y = tm->tm_year + 1900LL - (tm->tm_mon < 2);
+	long long era = (y >= 0 ? y : y - 399) / 400;
+	long long yoe = y - era * 400;
+	long long doy, days;
+
+	doy = (153 * ((tm->tm_mon + 10) % 12) + 2) / 5 + tm->tm_mday - 1;
+	days = era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+
+	return days * 86400 + tm->tm_hour * 3600 + tm->tm_min * 60 + tm->tm_sec;
+}
+
+/*
+ * Image data never changes, the client copy is valid if it has the same
+ * hash or, without If-None-Match, if it was obtained after the upload.
+ */
+static bool
+fresh(const struct kreq *r, const char *etag, time_t timestamp)
+{
+	struct tm tm = {0};
+	const char *end;
+
+	if (r->reqmap[KREQU_IF_NONE_MATCH])
+		return etag[0] && match(r->reqmap[KREQU_IF_NONE_MATCH]->val, etag);
+	if (!r->reqmap[KREQU_IF_MODIFIED_SINCE])
+		return false;
+
+	end = strptime(r->reqmap[KREQU_IF_MODIFIED_SINCE]->val,
+	    "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+	return end && !*end && utc(&tm) >= timestamp;
+}
+
+/* Validators and cache lifetime, also sent with 304 responses. */
+static void
+validators(struct kreq *r,
+           const struct image *image,
+           const char *etag,
+           const char *modified)
+{
+	const long long left = difftime(image->expires, time(NULL));
+
+	if (etag[0])
+		khttp_head(r, kresps[KRESP_ETAG], "%s", etag);
+
+	khttp_head(r, kresps[KRESP_LAST_MODIFIED], "%s", modified);
+
+	/* Caches must not keep it after its deletion. */
+	if (left > 0)
+		khttp_head(r, kresps[KRESP_CACHE_CONTROL], "public, max-age=%lld, immutable", left);
+	else
+		khttp_head(r, kresps[KRESP_CACHE_CONTROL], "no-cache");
+}
+
 static void
 get(struct kreq *r)
 {
 	struct image image = {0};
+	char value[PATH_MAX * 3 + 64], etag[80] = "", modified[64];
+	const char *header;
+	struct tm tm;
 
-	if (!database_get(&image, r->path))
+	if (!database_get_meta(&image, r->path))
 		page(r, NULL, KHTTP_404, "pages/404.html", "404");
 	else {
+		if (image.hash)
+			snprintf(etag, sizeof (etag), "\"%s\"", image.hash);
+
+		gmtime_r(&image.timestamp, &tm);
+		strftime(modified, sizeof (modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+		/* Neither the storage nor the blob is touched. */
+		if (fresh(r, etag, image.timestamp)) {
+			khttp_head(r, kresps[KRESP_STATUS], "%s", khttps[KHTTP_304]);
+			validators(r, &image, etag, modified);
+			khttp_body(r);
+			khttp_free(r);
+			image_finish(&image);
+			return;
+		}
+
+		header = offload(&image, value, sizeof (value));
+
 		khttp_head(r, kresps[KRESP_CONTENT_TYPE], "%s", kmimetypes[KMIME_APP_OCTET_STREAM]);
-		khttp_head(r, kresps[KRESP_CONTENT_LENGTH], "%llu", (unsigned long long)image.datasz);
 		khttp_head(r, kresps[KRESP_CONNECTION], "keep-alive");
 		khttp_head(r, kresps[KRESP_CONTENT_DISPOSITION],
 		    "attachment; filename=\"%s\"", image.id);
-		khttp_body(r);
-		khttp_write(r, image.data, image.datasz);
+		validators(r, &image, etag, modified);
+
+		/* The front-end server sets the length from the file. */
+		if (header) {
+			khttp_head(r, header, "%s", value);
+			khttp_body(r);
+		} else {
+			khttp_head(r, kresps[KRESP_CONTENT_LENGTH], "%llu", (unsigned long long)image.datasz);
+			khttp_body(r);
+
+			/* Headers are sent, the client sees a truncated body on error. */
+			if (!database_stream(image.id, chunk, r))
+				log_warn("download: unable to send image %s", image.id);
+		}
+
 		khttp_free(r);
 		image_finish(&image);
 	}
@@ -21,6 +21,7 @@
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <time.h>
 
 #include <kcgi.h>
 #include <kcgihtml.h>
@@ -51,6 +52,7 @@ template(size_t keyword, void *arg)
 {
 	const struct template *tp = arg;
 	struct khtmlreq html;
+	struct tm tm;
 
 	khtml_open(&html, tp->req, KHTML_PRETTY);
 
@@ -59,10 +61,10 @@ template(size_t keyword, void *arg)
 		khtml_puts(&html, tp->image->author);
 		break;
 	case 1:
-		khtml_puts(&html, bstrftime("%c", localtime(&tp->image->timestamp)));
+		khtml_puts(&html, bstrftime("%c", localtime_r(&tp->image->timestamp, &tm)));
 		break;
 	case 2:
-		khtml_puts(&html, ttl(tp->image->timestamp, tp->image->duration));
+		khtml_puts(&html, ttl(tp->image->expires));
 		break;
 	case 3:
 		khtml_puts(&html, tp->image->filename);
@@ -100,7 +102,7 @@ get(struct kreq *r)
 		.arg = &data
 	};
 
-	if (!database_get(&image, r->path))
+	if (!database_get_meta(&image, r->path))
 		page(r, NULL, KHTTP_404, "pages/404.html", "404");
 	else {
 		page(r, &kt, KHTTP_200, "pages/image.html", image.title);
@@ -18,13 +18,17 @@
 
 #include <sys/types.h>
 #include <assert.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <kcgi.h>
 
 #include "database.h"
 #include "fragment-image.h"
+#include "fragment-next.h"
 #include "image.h"
 #include "page-index.h"
 #include "page.h"
@@ -34,10 +38,12 @@ struct template {
 	struct kreq *req;
 	const struct image *images;
 	size_t imagesz;
+	const char *next;
 };
 
 static const char *keywords[] = {
-	"images"
+	"images",
+	"next"
 };
 
 static int
@@ -50,6 +56,10 @@ template(size_t keyword, void *arg)
 		for (size_t i = 0; i < tp->imagesz; ++i)
 			fragment_image(tp->req, &tp->images[i]);
 		break;
+	case 1:
+		if (tp->next)
+			fragment_next(tp->req, tp->next);
+		break;
 	default:
 		break;
 	}
@@ -60,21 +70,65 @@ template(size_t keyword, void *arg)
 static void
 get(struct kreq *r)
 {
-	struct image images[10] = {0};
+	struct image images[PAGE_INDEX_MAX + 1] = {0};
+	struct image before = {0};
 	size_t imagesz = NELEM(images);
 
-	if (!database_recents(images, &imagesz))
+	if (!page_index_before(r, &before))
+		page(r, NULL, KHTTP_400, "pages/400.html", "400");
+	else if (!database_recents(images, &imagesz, before.id ? &before : NULL))
 		page(r, NULL, KHTTP_500, "pages/500.html", "500");
 	else
-		page_index_render(r, images, imagesz);
+		page_index_render(r, images, imagesz, "/");
 
 	for (size_t i = 0; i < imagesz; ++i)
 		image_finish(&images[i]);
+
+	image_finish(&before);
+}
+
+bool
+page_index_before(struct kreq *r, struct image *before)
+{
+	assert(r);
+	assert(before);
+
+	const char *val = NULL;
+	char *end;
+	long long timestamp;
+
+	memset(before, 0, sizeof (*before));
+
+	for (size_t i = 0; i < r->fieldsz; ++i)
+		if (strcmp(r->fields[i].key, "before") == 0)
+			val = r->fields[i].val;
+
+	if (!val || !*val)
+		return true;
+
+	/* Format is <timestamp>-<id>. */
+	errno = 0;
+	timestamp = strtoll(val, &end, 10);
+
+	if (end == val || errno == ERANGE || *end != '-' ||
+	    !database_isid(end + 1))
+		return false;
+
+	before->timestamp = timestamp;
+	before->id = estrdup(end + 1);
+
+	return true;
 }
 
 void
-page_index_render(struct kreq *r, const struct image *images, size_t imagesz)
+page_index_render(struct kreq *r,
+                  const struct image *images,
+                  size_t imagesz,
+                  const char *url)
 {
+	assert(r);
+	assert(url);
+
 	struct template data = {
 		.req = r,
 		.images = images,
@@ -87,8 +141,21 @@ page_index_render(struct kreq *r, const struct image *images, size_t imagesz)
 		.arg = &data,
 		.cb = template
 	};
+	char *next = NULL;
+
+	/* The extra image is not shown, it only tells there is a next page. */
+	if (imagesz > PAGE_INDEX_MAX) {
+		const struct image *last = &images[PAGE_INDEX_MAX - 1];
+
+		kasprintf(&next, "%s%cbefore=%lld-%s", url, strchr(url, '?') ? '&' : '?',
+		    (long long int)last->timestamp, last->id);
+
+		data.imagesz = PAGE_INDEX_MAX;
+		data.next = next;
+	}
 
 	page(r, &kt, KHTTP_200, "pages/index.html", "Recent images");
+	free(next);
 }
 
 void
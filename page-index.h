@@ -19,13 +19,39 @@
 #ifndef IMGUP_PAGE_INDEX_H
 #define IMGUP_PAGE_INDEX_H
 
+#include <stdbool.h>
 #include <stddef.h>
 
+#define PAGE_INDEX_MAX 10               /*!< Images shown per page. */
+
 struct image;
 struct kreq;
 
+/**
+ * Parse the optional before query argument into the image timestamp and id
+ * to be passed to database_recents or database_search. The id is left NULL
+ * if there is none, the argument is invalid if the timestamp is out of range
+ * or the id is malformed.
+ *
+ * \param r the request
+ * \param before the image to fill
+ * \return false if the argument is invalid
+ */
+bool
+page_index_before(struct kreq *, struct image *);
+
+/**
+ * Render the list of images, when more than PAGE_INDEX_MAX are given the
+ * remaining ones are not shown and a link to the next page is appended to
+ * url instead.
+ *
+ * \param r the request
+ * \param images the images
+ * \param imagesz the number of images
+ * \param url the current page URL, without pagination
+ */
 void
-page_index_render(struct kreq *, const struct image *, size_t);
+page_index_render(struct kreq *, const struct image *, size_t, const char *);
 
 void
 page_index(struct kreq *);
@@ -24,12 +24,14 @@
 
 #include <kcgi.h>
 
+#include "config.h"
 #include "database.h"
 #include "fragment-duration.h"
 #include "image.h"
 #include "page-new.h"
 #include "page.h"
 #include "util.h"
+#include "writer.h"
 
 static const char *keywords[] = {
 	"durations"
@@ -96,6 +98,7 @@ post(struct kreq *r)
 		.duration       = IMAGE_DURATION_DAY
 	};
 	int raw = 0;
+	bool inserted;
 
 	for (size_t i = 0; i < r->fieldsz; ++i) {
 		const char *key = r->fields[i].key;
@@ -111,7 +114,8 @@ post(struct kreq *r)
 			if (r->fields[i].file)
 				replace(&image.filename, r->fields[i].file);
 
-			image.data = ememdup(r->fields[i].val, r->fields[i].valsz);	
+			/* Borrowed from kcgi rather than copied. */
+			image.data = r->fields[i].val;
 			image.datasz = r->fields[i].valsz;
 		} else if (strcmp(key, "private") == 0)
 			image.visible = strcmp(val, "on") != 0;
@@ -120,9 +124,17 @@ post(struct kreq *r)
 	}
 
 	/* TODO: image_isvalid should check for all stuff. */
-	if (!image.data || !image_isvalid(image.data, image.datasz))
+	if (!image.data || !image_isvalid(image.data, image.datasz)) {
 		page(r, NULL, KHTTP_400, "pages/400.html", "400");
-	else if (!database_insert(&image))
+		goto end;
+	}
+
+	if (config.writer[0])
+		inserted = writer_insert(config.writer, &image);
+	else
+		inserted = database_insert(&image);
+
+	if (!inserted)
 		page(r, NULL, KHTTP_500, "pages/500.html", "500");
 	else {
 		if (raw) {
@@ -142,6 +154,9 @@ post(struct kreq *r)
 		}
 	}
 
+end:
+	/* The data belongs to kcgi. */
+	image.data = NULL;
 	image_finish(&image);
 }
 
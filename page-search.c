@@ -21,6 +21,7 @@
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <kcgi.h>
@@ -33,18 +34,14 @@
 #include "util.h"
 
 static void
-get(struct kreq *r)
+results(struct kreq *r)
 {
-	page(r, NULL, KHTTP_200, "pages/search.html", "Search");
-}
-
-static void
-post(struct kreq *r)
-{
-	struct image images[10] = {0};
+	struct image images[PAGE_INDEX_MAX + 1] = {0};
+	struct image before = {0};
 	size_t imagesz = NELEM(images);
 	const char *title = NULL;
 	const char *author = NULL;
+	char *url, *etitle, *eauthor;
 
 	for (size_t i = 0; i < r->fieldsz; ++i) {
 		const char *key = r->fields[i].key;
@@ -56,19 +53,41 @@ post(struct kreq *r)
 			author = val;
 	}
 
+	/* Next pages are plain links so the criteria go in the URL. */
+	etitle = khttp_urlencode(title ? title : "");
+	eauthor = khttp_urlencode(author ? author : "");
+	kasprintf(&url, "/search?title=%s&author=%s", etitle, eauthor);
+
 	/* Sets to null if they are empty. */
 	if (title && strlen(title) == 0)
 		title = NULL;
 	if (author && strlen(author) == 0)
 		author = NULL;
 
-	if (!database_search(images, &imagesz, title, author))
+	if (!page_index_before(r, &before))
+		page(r, NULL, KHTTP_400, "pages/400.html", "400");
+	else if (!database_search(images, &imagesz, title, author, before.id ? &before : NULL))
 		page(r, NULL, KHTTP_500, "pages/500.html", "500");
 	else
-		page_index_render(r, images, imagesz);
+		page_index_render(r, images, imagesz, url);
 
 	for (size_t i = 0; i < imagesz; ++i)
 		image_finish(&images[i]);
+
+	image_finish(&before);
+	free(etitle);
+	free(eauthor);
+	free(url);
+}
+
+static void
+get(struct kreq *r)
+{
+	/* Links to the next results come with the criteria. */
+	if (r->fieldsz)
+		results(r);
+	else
+		page(r, NULL, KHTTP_200, "pages/search.html", "Search");
 }
 
 void
@@ -81,7 +100,7 @@ page_search(struct kreq *r)
 		get(r);
 		break;
 	case KMETHOD_POST:
-		post(r);
+		results(r);
 		break;
 	default:
 		page(r, NULL, KHTTP_400, "pages/400.html", "400");
@@ -0,0 +1,54 @@
+/*
+ * sha256.h -- SHA-256 message digest
+ *
+ * Copyright (c) 2020-2023 David Demelier <markand@malikania.fr>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef IMGUP_SHA256_H
+#define IMGUP_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_HEX_LEN  65              /*!< Hexadecimal digest with NUL. */
+
+struct sha256 {
+	uint32_t state[8];
+	uint64_t length;
+	unsigned char block[64];
+};
+
+void
+sha256_init(struct sha256 *);
+
+void
+sha256_update(struct sha256 *, const void *, size_t);
+
+/**
+ * Write the digest as a NUL terminated lowercase hexadecimal string.
+ *
+ * \param ctx the context
+ * \param hex the output, must be at least SHA256_HEX_LEN long
+ */
+void
+sha256_finish(struct sha256 *, char *);
+
+/**
+ * Convenient function to compute the digest of a buffer at once.
+ */
+void
+sha256(const void *, size_t, char *);
+
+#endif /* !IMGUP_SHA256_H */
@@ -0,0 +1,234 @@
+/*
+ * storage-fs.c -- content addressed file storage
+ *
+ * Copyright (c) 2020-2023 David Demelier <markand@malikania.fr>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "log.h"
+#include "storage-fs.h"
+
+/*
+ * Files are spread in subdirectories named after the first two characters
+ * of the hash to keep directories reasonably small.
+ */
+static const char *
+file(const char *hash)
+{
+	static _Thread_local char path[PATH_MAX];
+
+	snprintf(path, sizeof (path), "%s/%.2s/%s", config.blobdir, hash, hash);
+
+	return path;
+}
+
+static bool
+mkdirs(const char *hash)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof (path), "%s/%.2s", config.blobdir, hash);
+
+	if (mkdir(config.blobdir, 0755) < 0 && errno != EEXIST)
+		return false;
+	if (mkdir(path, 0755) < 0 && errno != EEXIST)
+		return false;
+
+	return true;
+}
+
+static bool
+init(sqlite3 *reader, sqlite3 *writer)
+{
+	(void)reader;
+	(void)writer;
+
+	return true;
+}
+
+static bool
+put(const char *hash, const void *data, size_t datasz)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	const unsigned char *p = data;
+	ssize_t nw;
+	int fd;
+
+	snprintf(path, sizeof (path), "%s", file(hash));
+
+	if (!mkdirs(hash))
+		goto err;
+
+	/* Written aside and renamed so that readers never see partial data. */
+	snprintf(tmp, sizeof (tmp), "%s.%ld", path, (long)getpid());
+
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		goto err;
+
+	for (; datasz; datasz -= nw, p += nw) {
+		if ((nw = write(fd, p, datasz)) < 0) {
+			if (errno == EINTR) {
+				nw = 0;
+				continue;
+			}
+
+			goto unlink_err;
+		}
+	}
+
+	if (fsync(fd) < 0 || close(fd) < 0) {
+		fd = -1;
+		goto unlink_err;
+	}
+	if (rename(tmp, path) < 0)
+		goto unlink_err;
+
+	return true;
+
+unlink_err:
+	if (fd >= 0)
+		close(fd);
+
+	unlink(tmp);
+
+err:
+	log_warn("storage: unable to write %s: %s", path, strerror(errno));
+
+	return false;
+}
+
+static bool
+lookup(const char *hash, size_t *datasz)
+{
+	struct stat st;
+
+	if (stat(file(hash), &st) < 0)
+		return false;
+
+	*datasz = st.st_size;
+
+	return true;
+}
+
+static void *
+get(const char *hash, size_t *datasz)
+{
+	struct stat st;
+	unsigned char *data;
+	size_t nr = 0;
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(file(hash), O_RDONLY)) < 0)
+		goto err;
+	if (fstat(fd, &st) < 0)
+		goto close_err;
+	if (!(data = malloc(st.st_size ? st.st_size : 1)))
+		goto close_err;
+
+	while (nr < (size_t)st.st_size) {
+		if ((n = read(fd, data + nr, st.st_size - nr)) <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+
+			free(data);
+			goto close_err;
+		}
+
+		nr += n;
+	}
+
+	close(fd);
+	*datasz = nr;
+
+	return data;
+
+close_err:
+	close(fd);
+
+err:
+	log_warn("storage: unable to read %s: %s", file(hash), strerror(errno));
+
+	return NULL;
+}
+
+static bool
+stream(const char *hash, database_stream_fn fn, void *arg)
+{
+	unsigned char buf[32768];
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(file(hash), O_RDONLY)) < 0) {
+		log_warn("storage: unable to open %s: %s", file(hash), strerror(errno));
+		return false;
+	}
+
+	while ((n = read(fd, buf, sizeof (buf))) != 0) {
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 || !fn(buf, n, arg))
+			break;
+	}
+
+	close(fd);
+
+	return n == 0;
+}
+
+static bool
+position(const char *hash, const char **path, off_t *offset, size_t *datasz)
+{
+	if (!lookup(hash, datasz))
+		return false;
+
+	*path = file(hash);
+	*offset = 0;
+
+	return true;
+}
+
+static void
+drop(const char *hash)
+{
+	if (unlink(file(hash)) < 0 && errno != ENOENT)
+		log_warn("storage: unable to remove %s: %s", file(hash), strerror(errno));
+}
+
+static void
+finish(void)
+{
+}
+
+const struct storage storage_fs = {
+	.name = "fs",
+	.open = init,
+	.put = put,
+	.stat = lookup,
+	.get = get,
+	.stream = stream,
+	.locate = position,
+	.remove = drop,
+	.finish = finish
+};
@@ -0,0 +1,146 @@
+/*
+ * storage-memory.c -- image data kept in memory
+ *
+ * Copyright (c) 2020-2023 David Demelier <markand@malikania.fr>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "storage-memory.h"
+#include "util.h"
+
+/* Like database connections, each thread has its own images. */
+static _Thread_local struct entry {
+	char *key;
+	void *data;
+	size_t datasz;
+	struct entry *next;
+} *entries;
+
+static struct entry *
+find(const char *key)
+{
+	for (struct entry *e = entries; e; e = e->next)
+		if (strcmp(e->key, key) == 0)
+			return e;
+
+	return NULL;
+}
+
+static bool
+init(sqlite3 *reader, sqlite3 *writer)
+{
+	(void)reader;
+	(void)writer;
+
+	return true;
+}
+
+static bool
+put(const char *key, const void *data, size_t datasz)
+{
+	struct entry *e;
+
+	if (!(e = calloc(1, sizeof (*e))))
+		return false;
+
+	e->key = estrdup(key);
+	e->data = datasz ? ememdup(data, datasz) : NULL;
+	e->datasz = datasz;
+	e->next = entries;
+	entries = e;
+
+	return true;
+}
+
+static bool
+lookup(const char *key, size_t *datasz)
+{
+	const struct entry *e;
+
+	if (!(e = find(key)))
+		return false;
+
+	*datasz = e->datasz;
+
+	return true;
+}
+
+static void *
+get(const char *key, size_t *datasz)
+{
+	const struct entry *e;
+
+	if (!(e = find(key)))
+		return NULL;
+
+	*datasz = e->datasz;
+
+	return e->datasz ? ememdup(e->data, e->datasz) : NULL;
+}
+
+static bool
+stream(const char *key, database_stream_fn fn, void *arg)
+{
+	const struct entry *e;
+
+	if (!(e = find(key)))
+		return false;
+
+	return fn(e->data, e->datasz, arg);
+}
+
+static void
+drop(const char *key)
+{
+	struct entry **p, *e;
+
+	for (p = &entries; (e = *p); p = &e->next) {
+		if (strcmp(e->key, key) == 0) {
+			*p = e->next;
+			free(e->key);
+			free(e->data);
+			free(e);
+			break;
+		}
+	}
+}
+
+static void
+finish(void)
+{
+	struct entry *e, *next;
+
+	for (e = entries; e; e = next) {
+		next = e->next;
+		free(e->key);
+		free(e->data);
+		free(e);
+	}
+
+	entries = NULL;
+}
+
+const struct storage storage_memory = {
+	.name = "memory",
+	.open = init,
+	.put = put,
+	.stat = lookup,
+	.get = get,
+	.stream = stream,
+	.remove = drop,
+	.finish = finish
+};
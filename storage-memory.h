@@ -0,0 +1,32 @@
+/*
+ * storage-memory.h -- image data kept in memory
+ *
+ * Copyright (c) 2020-2023 David Demelier <markand@malikania.fr>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef IMGUP_STORAGE_MEMORY_H
+#define IMGUP_STORAGE_MEMORY_H
+
+/*
+ * Image data kept in the process memory until database_finish, meant for
+ * unit tests and benchmarks of the other backends. It is not available to
+ * imgupd, tests enable it with database_register_storage.
+ */
+
+#include "storage.h"
+
+extern const struct storage storage_memory;
+
+#endif /* !IMGUP_STORAGE_MEMORY_H */
@@ -0,0 +1,682 @@
+/*
+ * storage-pack.c -- append-only pack file storage
+ *
+ * Copyright (c) 2020-2023 David Demelier <markand@malikania.fr>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "log.h"
+#include "storage-pack.h"
+#include "util.h"
+
+static const char sql_locate[] =
+	"SELECT pack\n"
+	"     , start\n"
+	"     , length\n"
+	"  FROM image_pack\n"
+	" WHERE blob = ?";
+
+static const char sql_last[] =
+	"SELECT COALESCE(MAX(pack), 0)\n"
+	"  FROM image_pack";
+
+static const char sql_insert[] =
+	"INSERT INTO image_pack(blob, pack, start, length) VALUES (?, ?, ?, ?)";
+
+static const char sql_remove[] =
+	"DELETE\n"
+	"  FROM image_pack\n"
+	" WHERE blob = ?";
+
+static const char sql_live[] =
+	"SELECT COALESCE(SUM(length), 0)\n"
+	"  FROM image_pack\n"
+	" WHERE pack = ?";
+
+static const char sql_images[] =
+	"SELECT blob\n"
+	"     , start\n"
+	"     , length\n"
+	"  FROM image_pack\n"
+	" WHERE pack = ?\n"
+	" ORDER BY start";
+
+static const char sql_move[] =
+	"UPDATE image_pack\n"
+	"   SET pack = ?\n"
+	"     , start = ?\n"
+	" WHERE blob = ?";
+
+enum stmt {
+	STMT_LOCATE,
+	STMT_LAST,
+	STMT_INSERT,
+	STMT_REMOVE,
+	STMT_LIVE,
+	STMT_IMAGES,
+	STMT_MOVE,
+	STMT_NUM
+};
+
+/*
+ * Only lookups go through the reader, the other statements run within the
+ * write transactions of database_insert, database_clear and compaction.
+ */
+static const struct {
+	const char *sql;
+	bool write;
+} sql[] = {
+	[STMT_LOCATE]   = { sql_locate, false   },
+	[STMT_LAST]     = { sql_last,   true    },
+	[STMT_INSERT]   = { sql_insert, true    },
+	[STMT_REMOVE]   = { sql_remove, true    },
+	[STMT_LIVE]     = { sql_live,   true    },
+	[STMT_IMAGES]   = { sql_images, true    },
+	[STMT_MOVE]     = { sql_move,   true    }
+};
+
+static _Thread_local sqlite3 *rdb, *wdb;
+static _Thread_local sqlite3_stmt *stmts[STMT_NUM];
+
+static const char *
+file(unsigned int pack)
+{
+	static _Thread_local char path[PATH_MAX];
+
+	snprintf(path, sizeof (path), "%s/pack-%08u", config.blobdir, pack);
+
+	return path;
+}
+
+static int
+cmp(const void *v1, const void *v2)
+{
+	const unsigned int p1 = *(const unsigned int *)v1;
+	const unsigned int p2 = *(const unsigned int *)v2;
+
+	return p1 < p2 ? -1 : p1 > p2;
+}
+
+/*
+ * Append data at the end of a pack, the pack is set to the next one if it
+ * is full. The data is not synchronized to disk until flush is called.
+ */
+static bool
+append(unsigned int *pack, const void *data, size_t datasz, off_t *offset)
+{
+	const unsigned char *p = data;
+	struct stat st;
+	ssize_t nw;
+	int fd;
+
+	if (mkdir(config.blobdir, 0755) < 0 && errno != EEXIST)
+		goto err;
+	if ((fd = open(file(*pack), O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0)
+		goto err;
+	if (fstat(fd, &st) < 0)
+		goto close_err;
+
+	if (st.st_size >= STORAGE_PACK_MAX) {
+		close(fd);
+		*pack += 1;
+
+		if ((fd = open(file(*pack), O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0)
+			goto err;
+		if (fstat(fd, &st) < 0)
+			goto close_err;
+	}
+
+	*offset = st.st_size;
+
+	for (; datasz; datasz -= nw, p += nw) {
+		if ((nw = write(fd, p, datasz)) < 0) {
+			if (errno == EINTR) {
+				nw = 0;
+				continue;
+			}
+
+			goto close_err;
+		}
+	}
+
+	if (close(fd) < 0)
+		goto err;
+
+	return true;
+
+close_err:
+	close(fd);
+
+err:
+	log_warn("storage: unable to write %s: %s", file(*pack), strerror(errno));
+
+	return false;
+}
+
+static bool
+flush(unsigned int pack)
+{
+	int fd;
+
+	if ((fd = open(file(pack), O_WRONLY)) < 0 || fsync(fd) < 0) {
+		log_warn("storage: unable to sync %s: %s", file(pack), strerror(errno));
+
+		if (fd >= 0)
+			close(fd);
+
+		return false;
+	}
+
+	return close(fd) == 0;
+}
+
+static void *
+load(unsigned int pack, off_t offset, size_t datasz)
+{
+	unsigned char *data;
+	size_t nr = 0;
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(file(pack), O_RDONLY)) < 0)
+		goto err;
+	if (!(data = malloc(datasz ? datasz : 1)))
+		goto close_err;
+
+	/* One call in practice, more only if interrupted. */
+	while (nr < datasz) {
+		if ((n = pread(fd, data + nr, datasz - nr, offset + nr)) <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n == 0)
+				errno = EIO;
+
+			free(data);
+			goto close_err;
+		}
+
+		nr += n;
+	}
+
+	close(fd);
+
+	return data;
+
+close_err:
+	close(fd);
+
+err:
+	log_warn("storage: unable to read %s: %s", file(pack), strerror(errno));
+
+	return NULL;
+}
+
+static bool
+stream_at(unsigned int pack,
+          off_t offset,
+          size_t datasz,
+          database_stream_fn fn,
+          void *arg)
+{
+	unsigned char buf[32768];
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(file(pack), O_RDONLY)) < 0) {
+		log_warn("storage: unable to open %s: %s", file(pack), strerror(errno));
+		return false;
+	}
+
+	while (datasz) {
+		n = pread(fd, buf, datasz < sizeof (buf) ? datasz : sizeof (buf), offset);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0 || !fn(buf, n, arg))
+			break;
+
+		offset += n;
+		datasz -= n;
+	}
+
+	close(fd);
+
+	return datasz == 0;
+}
+
+/* Current size of a pack, including the data no longer used. */
+static off_t
+pack_size(unsigned int pack)
+{
+	struct stat st;
+
+	if (stat(file(pack), &st) < 0)
+		return -1;
+
+	return st.st_size;
+}
+
+/* Existing packs in increasing order, NULL if there is none. */
+static unsigned int *
+scan(size_t *packsz)
+{
+	unsigned int *packs = NULL, pack;
+	struct dirent *entry;
+	DIR *dir;
+	char c;
+
+	*packsz = 0;
+
+	if (!(dir = opendir(config.blobdir)))
+		return NULL;
+
+	while ((entry = readdir(dir))) {
+		/* The trailing character rejects temporary or foreign files. */
+		if (sscanf(entry->d_name, "pack-%u%c", &pack, &c) != 1)
+			continue;
+		if (!(packs = realloc(packs, (*packsz + 1) * sizeof (*packs))))
+			die("abort: %s", strerror(errno));
+
+		packs[(*packsz)++] = pack;
+	}
+
+	closedir(dir);
+	qsort(packs, *packsz, sizeof (*packs), cmp);
+
+	return packs;
+}
+
+static void
+unlink_pack(unsigned int pack)
+{
+	if (unlink(file(pack)) < 0 && errno != ENOENT)
+		log_warn("storage: unable to remove %s: %s", file(pack), strerror(errno));
+}
+
+static void
+reset(sqlite3_stmt *stmt)
+{
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+}
+
+static bool
+locate(const char *key, unsigned int *pack, off_t *start, size_t *length)
+{
+	sqlite3_stmt *stmt = stmts[STMT_LOCATE];
+	bool ret = false;
+
+	if (sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC) == SQLITE_OK &&
+	    sqlite3_step(stmt) == SQLITE_ROW) {
+		*pack = sqlite3_column_int64(stmt, 0);
+		*start = sqlite3_column_int64(stmt, 1);
+		*length = sqlite3_column_int64(stmt, 2);
+		ret = true;
+	}
+
+	reset(stmt);
+
+	return ret;
+}
+
+/* Pack to which new images are appended. */
+static bool
+last(unsigned int *pack)
+{
+	sqlite3_stmt *stmt = stmts[STMT_LAST];
+	bool ret = false;
+
+	if (sqlite3_step(stmt) == SQLITE_ROW) {
+		*pack = sqlite3_column_int64(stmt, 0);
+		ret = true;
+	}
+
+	reset(stmt);
+
+	return ret;
+}
+
+/* Number of bytes still used in a pack, -1 on errors. */
+static off_t
+live(unsigned int pack)
+{
+	sqlite3_stmt *stmt = stmts[STMT_LIVE];
+	off_t ret = -1;
+
+	if (sqlite3_bind_int64(stmt, 1, pack) == SQLITE_OK &&
+	    sqlite3_step(stmt) == SQLITE_ROW)
+		ret = sqlite3_column_int64(stmt, 0);
+
+	reset(stmt);
+
+	return ret;
+}
+
+static bool
+init(sqlite3 *reader, sqlite3 *writer)
+{
+	sqlite3 *db;
+
+	rdb = reader;
+	wdb = writer;
+
+	for (size_t i = 0; i < NELEM(stmts); ++i) {
+		if (!(db = sql[i].write ? wdb : rdb))
+			continue;
+		if (sqlite3_prepare_v3(db, sql[i].sql, -1, SQLITE_PREPARE_PERSISTENT,
+		    &stmts[i], NULL) != SQLITE_OK) {
+			log_warn("storage: unable to prepare statement: %s", sqlite3_errmsg(db));
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * If the transaction fails afterwards, the bytes are left unused until the
+ * pack is compacted.
+ */
+static bool
+put(const char *key, const void *data, size_t datasz)
+{
+	sqlite3_stmt *stmt = stmts[STMT_INSERT];
+	unsigned int pack;
+	off_t start;
+
+	if (!last(&pack) ||
+	    !append(&pack, data, datasz, &start) ||
+	    !flush(pack))
+		return false;
+
+	sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 2, pack);
+	sqlite3_bind_int64(stmt, 3, start);
+	sqlite3_bind_int64(stmt, 4, datasz);
+
+	if (sqlite3_step(stmt) != SQLITE_DONE) {
+		log_warn("storage: error (put): %s", sqlite3_errmsg(wdb));
+		reset(stmt);
+		return false;
+	}
+
+	reset(stmt);
+
+	return true;
+}
+
+static bool
+lookup(const char *key, size_t *datasz)
+{
+	unsigned int pack;
+	off_t start;
+
+	return locate(key, &pack, &start, datasz);
+}
+
+static void *
+get(const char *key, size_t *datasz)
+{
+	unsigned int pack;
+	off_t start;
+
+	if (!locate(key, &pack, &start, datasz))
+		return NULL;
+
+	return load(pack, start, *datasz);
+}
+
+static bool
+stream(const char *key, database_stream_fn fn, void *arg)
+{
+	unsigned int pack;
+	off_t start;
+	size_t length;
+
+	if (!locate(key, &pack, &start, &length))
+		return false;
+
+	return stream_at(pack, start, length, fn, arg);
+}
+
+/*
+ * Compaction may move the data afterwards, the old pack is only removed by
+ * the next one.
+ */
+static bool
+position(const char *key, const char **path, off_t *offset, size_t *datasz)
+{
+	unsigned int pack;
+
+	if (!locate(key, &pack, offset, datasz))
+		return false;
+
+	*path = file(pack);
+
+	return true;
+}
+
+/* The bytes themselves are reclaimed by compaction. */
+static void
+drop(const char *key)
+{
+	sqlite3_stmt *stmt = stmts[STMT_REMOVE];
+
+	if (sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC) != SQLITE_OK ||
+	    sqlite3_step(stmt) != SQLITE_DONE)
+		log_warn("storage: error (remove): %s", sqlite3_errmsg(wdb));
+
+	reset(stmt);
+}
+
+static void
+finish(void)
+{
+	for (size_t i = 0; i < NELEM(stmts); ++i) {
+		sqlite3_finalize(stmts[i]);
+		stmts[i] = NULL;
+	}
+
+	rdb = wdb = NULL;
+}
+
+/*
+ * Copy the images of a pack at the end of the packs being written, the
+ * caller holds the write lock.
+ */
+static bool
+compact(unsigned int from, unsigned int *to)
+{
+	sqlite3_stmt *images = stmts[STMT_IMAGES];
+	sqlite3_stmt *move = stmts[STMT_MOVE];
+	struct {
+		char *key;
+		off_t start;
+		size_t length;
+	} *list = NULL;
+	size_t listsz = 0;
+	unsigned int cur = *to;
+	void *data;
+	off_t start;
+	bool ret = false;
+
+	/* Collected first as the rows are updated below. */
+	if (sqlite3_bind_int64(images, 1, from) != SQLITE_OK)
+		goto sqlite_err;
+
+	while (sqlite3_step(images) == SQLITE_ROW) {
+		if (!(list = realloc(list, (listsz + 1) * sizeof (*list))))
+			die("abort: %s", strerror(errno));
+
+		list[listsz].key = estrdup((const char *)sqlite3_column_text(images, 0));
+		list[listsz].start = sqlite3_column_int64(images, 1);
+		list[listsz++].length = sqlite3_column_int64(images, 2);
+	}
+
+	reset(images);
+
+	for (size_t i = 0; i < listsz; ++i) {
+		if (!(data = load(from, list[i].start, list[i].length)))
+			goto err;
+		if (!append(to, data, list[i].length, &start)) {
+			free(data);
+			goto err;
+		}
+
+		free(data);
+
+		/* Full packs are flushed as soon as the next one is started. */
+		if (*to != cur && !flush(cur))
+			goto err;
+
+		cur = *to;
+		sqlite3_bind_int64(move, 1, *to);
+		sqlite3_bind_int64(move, 2, start);
+		sqlite3_bind_text(move, 3, list[i].key, -1, SQLITE_STATIC);
+
+		if (sqlite3_step(move) != SQLITE_DONE)
+			goto sqlite_err;
+
+		reset(move);
+	}
+
+	ret = true;
+	goto err;
+
+sqlite_err:
+	log_warn("storage: error (compact): %s", sqlite3_errmsg(wdb));
+
+err:
+	reset(images);
+	reset(move);
+
+	for (size_t i = 0; i < listsz; ++i)
+		free(list[i].key);
+
+	free(list);
+
+	return ret;
+}
+
+void
+storage_pack_compact(unsigned int threshold)
+{
+	unsigned int *packs, *moved, *empty, to;
+	size_t packsz, movedsz = 0, emptysz = 0;
+	off_t total, used;
+
+	/* Read-only. */
+	if (!wdb)
+		return;
+	if (!(packs = scan(&packsz)))
+		return;
+
+	log_debug("storage: compacting packs");
+
+	if (sqlite3_exec(wdb, "BEGIN IMMEDIATE TRANSACTION", NULL, NULL, NULL) != SQLITE_OK) {
+		log_warn("storage: could not lock database: %s", sqlite3_errmsg(wdb));
+		free(packs);
+		return;
+	}
+
+	/*
+	 * Rewritten packs go after every existing one, uploads only append
+	 * to the last pack referenced so none of them will use the old
+	 * ones again.
+	 */
+	if (!(moved = calloc(packsz, sizeof (*moved))) ||
+	    !(empty = calloc(packsz, sizeof (*empty))))
+		die("abort: %s", strerror(errno));
+
+	to = packs[packsz - 1] + 1;
+
+	for (size_t i = 0; i < packsz; ++i) {
+		if ((total = pack_size(packs[i])) < 0)
+			continue;
+		if ((used = live(packs[i])) < 0)
+			goto err;
+
+		/* Nothing refers to it anymore. */
+		if (used == 0) {
+			empty[emptysz++] = packs[i];
+			continue;
+		}
+
+		if ((total - used) * 100 < total * (off_t)threshold)
+			continue;
+		if (!compact(packs[i], &to))
+			goto err;
+
+		moved[movedsz++] = packs[i];
+	}
+
+	if (movedsz && !flush(to))
+		goto err;
+	if (sqlite3_exec(wdb, "COMMIT", NULL, NULL, NULL) != SQLITE_OK)
+		goto err;
+
+	/*
+	 * Packs moved above are left in place, readers that located an image
+	 * before the commit and paths handed to the front-end server still
+	 * use them. They are empty packs for the next compaction.
+	 *
+	 * An empty pack may be the one uploads append to, check again while
+	 * they are locked out.
+	 */
+	if (emptysz &&
+	    sqlite3_exec(wdb, "BEGIN IMMEDIATE TRANSACTION", NULL, NULL, NULL) == SQLITE_OK) {
+		for (size_t i = 0; i < emptysz; ++i)
+			if (live(empty[i]) == 0)
+				unlink_pack(empty[i]);
+
+		sqlite3_exec(wdb, "COMMIT", NULL, NULL, NULL);
+	}
+
+	log_info("storage: compacted %zu packs", movedsz);
+	free(moved);
+	free(empty);
+	free(packs);
+
+	return;
+
+err:
+	log_warn("storage: unable to compact packs");
+	sqlite3_exec(wdb, "ROLLBACK", NULL, NULL, NULL);
+	free(moved);
+	free(empty);
+	free(packs);
+}
+
+const struct storage storage_pack = {
+	.name = "pack",
+	.open = init,
+	.put = put,
+	.stat = lookup,
+	.get = get,
+	.stream = stream,
+	.locate = position,
+	.remove = drop,
+	.finish = finish
+};
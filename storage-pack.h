@@ -0,0 +1,47 @@
+/*
+ * storage-pack.h -- append-only pack file storage
+ *
+ * Copyright (c) 2020-2023 David Demelier <markand@malikania.fr>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef IMGUP_STORAGE_PACK_H
+#define IMGUP_STORAGE_PACK_H
+
+/*
+ * Image data appended one after the other into large numbered files under
+ * config.blobdir, the offset and length of every image is kept in the
+ * image_pack table. Appending while the database is locked for writing
+ * makes a single writer per pack.
+ */
+
+#include "storage.h"
+
+/*
+ * Once a pack reaches this size, new data goes to the next one.
+ */
+#define STORAGE_PACK_MAX (64LL * 1024 * 1024)
+
+extern const struct storage storage_pack;
+
+/**
+ * Rewrite the packs in which at least the given percentage of bytes is no
+ * longer used, see database_compact.
+ *
+ * \param threshold the percentage of unused bytes
+ */
+void
+storage_pack_compact(unsigned int);
+
+#endif /* !IMGUP_STORAGE_PACK_H */
@@ -0,0 +1,281 @@
+/*
+ * storage-sqlite.c -- image data stored in the database
+ *
+ * Copyright (c) 2020-2023 David Demelier <markand@malikania.fr>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "storage-sqlite.h"
+#include "util.h"
+
+/*
+ * The data is written afterwards with sqlite3_blob_write, directly into the
+ * database pages.
+ */
+static const char sql_insert[] =
+	"INSERT INTO image_data(blob, data) VALUES (?, zeroblob(?))";
+
+static const char sql_stat[] =
+	"SELECT rowid\n"
+	"     , LENGTH(data)\n"
+	"  FROM image_data\n"
+	" WHERE blob = ?";
+
+static const char sql_remove[] =
+	"DELETE\n"
+	"  FROM image_data\n"
+	" WHERE blob = ?";
+
+enum stmt {
+	STMT_INSERT,
+	STMT_STAT,
+	STMT_REMOVE,
+	STMT_NUM
+};
+
+/* Lookups go through the reader, changes through the writer. */
+static const struct {
+	const char *sql;
+	bool write;
+} sql[] = {
+	[STMT_INSERT]   = { sql_insert, true    },
+	[STMT_STAT]     = { sql_stat,   false   },
+	[STMT_REMOVE]   = { sql_remove, true    }
+};
+
+static _Thread_local sqlite3 *rdb, *wdb;
+static _Thread_local sqlite3_stmt *stmts[STMT_NUM];
+
+static void
+reset(sqlite3_stmt *stmt)
+{
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+}
+
+static bool
+locate(const char *key, sqlite3_int64 *rowid, size_t *datasz)
+{
+	sqlite3_stmt *stmt = stmts[STMT_STAT];
+	bool ret = false;
+
+	if (sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC) == SQLITE_OK &&
+	    sqlite3_step(stmt) == SQLITE_ROW) {
+		*rowid = sqlite3_column_int64(stmt, 0);
+		*datasz = sqlite3_column_int64(stmt, 1);
+		ret = true;
+	}
+
+	reset(stmt);
+
+	return ret;
+}
+
+static bool
+init(sqlite3 *reader, sqlite3 *writer)
+{
+	sqlite3 *db;
+
+	rdb = reader;
+	wdb = writer;
+
+	for (size_t i = 0; i < NELEM(stmts); ++i) {
+		if (!(db = sql[i].write ? wdb : rdb))
+			continue;
+		if (sqlite3_prepare_v3(db, sql[i].sql, -1, SQLITE_PREPARE_PERSISTENT,
+		    &stmts[i], NULL) != SQLITE_OK) {
+			log_warn("storage: unable to prepare statement: %s", sqlite3_errmsg(db));
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool
+put(const char *key, const void *data, size_t datasz)
+{
+	sqlite3_stmt *stmt = stmts[STMT_INSERT];
+	sqlite3_blob *blob = NULL;
+
+	sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 2, datasz);
+
+	if (sqlite3_step(stmt) != SQLITE_DONE)
+		goto sqlite_err;
+
+	/* Fill the zeroblob reserved above in place. */
+	if (datasz) {
+		if (sqlite3_blob_open(wdb, "main", "image_data", "data",
+		    sqlite3_last_insert_rowid(wdb), 1, &blob) != SQLITE_OK ||
+		    sqlite3_blob_write(blob, data, datasz, 0) != SQLITE_OK)
+			goto sqlite_err;
+
+		sqlite3_blob_close(blob);
+	}
+
+	reset(stmt);
+
+	return true;
+
+sqlite_err:
+	log_warn("storage: error (put): %s", sqlite3_errmsg(wdb));
+	sqlite3_blob_close(blob);
+	reset(stmt);
+
+	return false;
+}
+
+static bool
+lookup(const char *key, size_t *datasz)
+{
+	sqlite3_int64 rowid;
+
+	return locate(key, &rowid, datasz);
+}
+
+/*
+ * Without AUTOINCREMENT, the rowid of data removed by database_clear can be
+ * reused by the next upload. The rowid found by locate and the blob opened
+ * from it must come from the same read transaction, which lasts until the
+ * blob is closed.
+ */
+static bool
+begin(void)
+{
+	return sqlite3_exec(rdb, "BEGIN", NULL, NULL, NULL) == SQLITE_OK;
+}
+
+static void
+end(sqlite3_blob *blob)
+{
+	sqlite3_blob_close(blob);
+	sqlite3_exec(rdb, "COMMIT", NULL, NULL, NULL);
+}
+
+static void *
+get(const char *key, size_t *datasz)
+{
+	sqlite3_blob *blob = NULL;
+	sqlite3_int64 rowid;
+	void *data;
+
+	if (!begin())
+		goto sqlite_err;
+	if (!locate(key, &rowid, datasz)) {
+		end(NULL);
+		return NULL;
+	}
+	if (sqlite3_blob_open(rdb, "main", "image_data", "data", rowid, 0, &blob) != SQLITE_OK)
+		goto sqlite_err;
+
+	if (!(data = malloc(*datasz ? *datasz : 1)))
+		die("abort: %s", strerror(errno));
+	if (sqlite3_blob_read(blob, data, *datasz, 0) != SQLITE_OK) {
+		free(data);
+		goto sqlite_err;
+	}
+
+	end(blob);
+
+	return data;
+
+sqlite_err:
+	log_warn("storage: error (get): %s", sqlite3_errmsg(rdb));
+	end(blob);
+
+	return NULL;
+}
+
+static bool
+stream(const char *key, database_stream_fn fn, void *arg)
+{
+	sqlite3_blob *blob = NULL;
+	sqlite3_int64 rowid;
+	unsigned char buf[32768];
+	size_t size;
+	int offset = 0, len;
+
+	if (!begin())
+		goto sqlite_err;
+	if (!locate(key, &rowid, &size)) {
+		end(NULL);
+		return false;
+	}
+
+	/*
+	 * In WAL mode, uploads and clear can still proceed during the read
+	 * transaction while the client downloads.
+	 */
+	if (sqlite3_blob_open(rdb, "main", "image_data", "data", rowid, 0, &blob) != SQLITE_OK)
+		goto sqlite_err;
+
+	for (size = sqlite3_blob_bytes(blob); (size_t)offset < size; offset += len) {
+		len = size - offset < sizeof (buf) ? (int)(size - offset) : (int)sizeof (buf);
+
+		if (sqlite3_blob_read(blob, buf, len, offset) != SQLITE_OK)
+			goto sqlite_err;
+		if (!fn(buf, len, arg))
+			break;
+	}
+
+	end(blob);
+
+	return (size_t)offset >= size;
+
+sqlite_err:
+	log_warn("storage: error (stream): %s", sqlite3_errmsg(rdb));
+	end(blob);
+
+	return false;
+}
+
+static void
+drop(const char *key)
+{
+	sqlite3_stmt *stmt = stmts[STMT_REMOVE];
+
+	if (sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC) != SQLITE_OK ||
+	    sqlite3_step(stmt) != SQLITE_DONE)
+		log_warn("storage: error (remove): %s", sqlite3_errmsg(wdb));
+
+	reset(stmt);
+}
+
+static void
+finish(void)
+{
+	for (size_t i = 0; i < NELEM(stmts); ++i) {
+		sqlite3_finalize(stmts[i]);
+		stmts[i] = NULL;
+	}
+
+	rdb = wdb = NULL;
+}
+
+const struct storage storage_sqlite = {
+	.name = "sqlite",
+	.open = init,
+	.put = put,
+	.stat = lookup,
+	.get = get,
+	.stream = stream,
+	.remove = drop,
+	.finish = finish
+};
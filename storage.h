@@ -0,0 +1,111 @@
+/*
+ * storage.h -- image data backends
+ *
+ * Copyright (c) 2020-2023 David Demelier <markand@malikania.fr>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef IMGUP_STORAGE_H
+#define IMGUP_STORAGE_H
+
+/*
+ * Image metadata always lives in the image table while the data is kept by
+ * one of the backends below, selected with config.storage. Data is stored
+ * once per key, the SHA-256 of the content, whatever the number of images
+ * using it. Backends may keep their own index in the database, they are
+ * opened on the same connections once the schema is up to date: stat, get
+ * and stream only use the read-only one while put and remove use the other.
+ *
+ * The database is locked for writing while put and remove are called.
+ */
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <sqlite3.h>
+
+#include "database.h"
+
+struct storage {
+	/**
+	 * Backend name, as given in config.storage.
+	 */
+	const char *name;
+
+	/**
+	 * Prepare the backend.
+	 *
+	 * \param reader the read-only database connection
+	 * \param writer the read-write connection or NULL if read-only
+	 * \return false on errors
+	 */
+	bool (*open)(sqlite3 *, sqlite3 *);
+
+	/**
+	 * Store new data.
+	 *
+	 * \param key the data key
+	 * \param data the data
+	 * \param datasz the data size
+	 * \return false on errors
+	 */
+	bool (*put)(const char *, const void *, size_t);
+
+	/**
+	 * Tell if the backend holds the data.
+	 *
+	 * \param key the data key
+	 * \param datasz set to the data size
+	 * \return true if found
+	 */
+	bool (*stat)(const char *, size_t *);
+
+	/**
+	 * Load the whole data.
+	 *
+	 * \param key the data key
+	 * \param datasz set to the data size
+	 * \return the data to be freed or NULL on errors
+	 */
+	void *(*get)(const char *, size_t *);
+
+	/**
+	 * Same as database_stream for the given key.
+	 */
+	bool (*stream)(const char *, database_stream_fn, void *);
+
+	/**
+	 * Tell in which file the data is stored, NULL for backends not keeping
+	 * it in plain files.
+	 *
+	 * \param key the data key
+	 * \param path set to the file path, valid until the next call
+	 * \param offset set to the data offset in the file
+	 * \param datasz set to the data size
+	 * \return false if not found
+	 */
+	bool (*locate)(const char *, const char **, off_t *, size_t *);
+
+	/**
+	 * Remove the data once no image refers to it anymore.
+	 *
+	 * \param key the data key
+	 */
+	void (*remove)(const char *);
+
+	void (*finish)(void);
+};
+
+#endif /* !IMGUP_STORAGE_H */
@@ -16,14 +16,24 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <sqlite3.h>
+
 #define GREATEST_USE_ABBREVS 0
 #include <greatest.h>
 
+#include "config.h"
 #include "database.h"
 #include "image.h"
+#include "storage-memory.h"
 #include "util.h"
 
 #define TEST_DATABASE "test.db"
@@ -32,6 +42,8 @@ static void
 setup(void *data)
 {
 	remove(TEST_DATABASE);
+	remove(TEST_DATABASE "-shm");
+	remove(TEST_DATABASE "-wal");
 
 	if (!database_open(TEST_DATABASE))
 		die("abort: could not open database");
@@ -47,13 +59,65 @@ finish(void *data)
 	(void)data;
 }
 
+/*
+ * Run a single value query using a different connection, for checks that
+ * are not possible through the database API.
+ */
+static int
+count(const char *sql)
+{
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	int ret = -1;
+
+	if (sqlite3_open(TEST_DATABASE, &db) != SQLITE_OK)
+		die("abort: could not open database");
+	if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK) {
+		if (sqlite3_step(stmt) == SQLITE_ROW)
+			ret = sqlite3_column_int(stmt, 0);
+
+		sqlite3_finalize(stmt);
+	}
+
+	sqlite3_close(db);
+
+	return ret;
+}
+
+/*
+ * Complete images only given their data and duration with the same title,
+ * author and file name.
+ */
+static void
+fixture(struct image *images, size_t imagesz)
+{
+	for (size_t i = 0; i < imagesz; ++i) {
+		images[i].title = estrdup("test");
+		images[i].author = estrdup("unit test");
+		images[i].filename = estrdup("image.png");
+	}
+}
+
+/* Same as fixture but also insert them one at a time. */
+static bool
+populate(struct image *images, size_t imagesz)
+{
+	fixture(images, imagesz);
+
+	for (size_t i = 0; i < imagesz; ++i)
+		if (!database_insert(&images[i]))
+			return false;
+
+	return true;
+}
+
 GREATEST_TEST
 recents_empty(void)
 {
 	struct image images[10];
 	size_t max = 10;
 
-	if (!database_recents(images, &max))
+	if (!database_recents(images, &max, NULL))
 		GREATEST_FAIL();
 
 	GREATEST_ASSERT_EQ(max, 0);
@@ -77,14 +141,14 @@ recents_one(void)
 
 	if (!database_insert(&one))
 		GREATEST_FAIL();
-	if (!database_recents(images, &max))
+	if (!database_recents(images, &max, NULL))
 		GREATEST_FAIL();
 
 	GREATEST_ASSERT_EQ(max, 1);
 	GREATEST_ASSERT(images[0].id);
 	GREATEST_ASSERT_STR_EQ(images[0].title, "test 1");
 	GREATEST_ASSERT_STR_EQ(images[0].author, "unit test");
-	GREATEST_ASSERT_MEM_EQ(images[0].data, "PNG...", 6);
+	GREATEST_ASSERT(!images[0].data);
 	GREATEST_ASSERT_EQ(images[0].datasz, 6);
 	GREATEST_ASSERT_STR_EQ(images[0].filename, "image.png");
 	GREATEST_ASSERT_EQ(images[0].duration, IMAGE_DURATION_HOUR);
@@ -109,7 +173,7 @@ recents_hidden(void)
 
 	if (!database_insert(&one))
 		GREATEST_FAIL();
-	if (!database_recents(images, &max))
+	if (!database_recents(images, &max, NULL))
 		GREATEST_FAIL();
 
 	GREATEST_ASSERT_EQ(max, 0);
@@ -141,7 +205,7 @@ recents_many(void)
 		sleep(2);
 	};
 
-	if (!database_recents(images, &max))
+	if (!database_recents(images, &max, NULL))
 		GREATEST_FAIL();
 
 	GREATEST_ASSERT_EQ(max, 3U);
@@ -153,8 +217,7 @@ recents_many(void)
 		    bprintf("test %d", expected[i]));
 		GREATEST_ASSERT_STR_EQ(images[i].author,
 		    bprintf("unit test %d", expected[i]));
-		GREATEST_ASSERT_MEM_EQ(images[i].data,
-		    bprintf("PNG... %d", expected[i]), 6);
+		GREATEST_ASSERT(!images[i].data);
 		GREATEST_ASSERT_EQ(images[i].datasz, 8);
 		GREATEST_ASSERT_STR_EQ(images[i].filename,
 		    bprintf("%i.png", expected[i]));
@@ -190,7 +253,7 @@ recents_limits(void)
 		sleep(2);
 	};
 
-	if (!database_recents(images, &max))
+	if (!database_recents(images, &max, NULL))
 		GREATEST_FAIL();
 
 	GREATEST_ASSERT_EQ(max, 3U);
@@ -202,8 +265,7 @@ recents_limits(void)
 		    bprintf("test %d", expected[i]));
 		GREATEST_ASSERT_STR_EQ(images[i].author,
 		    bprintf("unit test %d", expected[i]));
-		GREATEST_ASSERT_MEM_EQ(images[i].data,
-		    bprintf("PNG... %d", expected[i]), 6);
+		GREATEST_ASSERT(!images[i].data);
 		GREATEST_ASSERT_EQ(images[i].datasz, 8);
 		GREATEST_ASSERT_STR_EQ(images[i].filename,
 		    bprintf("%i.png", expected[i]));
@@ -214,6 +276,79 @@ recents_limits(void)
 	GREATEST_PASS();
 }
 
+GREATEST_TEST
+recents_before(void)
+{
+	struct image images[2], last = {0};
+	struct image image = {
+		.duration = IMAGE_DURATION_HOUR,
+		.visible = true
+	};
+	size_t max, total = 0;
+
+	/* Same second for most of them, the id must break ties. */
+	for (int i = 0; i < 5; ++i) {
+		image.title = estrdup(bprintf("test %d", i));
+		image.author = estrdup("unit test");
+		image.data = estrdup("PNG...");
+		image.datasz = 6;
+		image.filename = estrdup("image.png");
+
+		if (!database_insert(&image))
+			GREATEST_FAIL();
+	}
+
+	do {
+		max = NELEM(images);
+
+		if (!database_recents(images, &max, total ? &last : NULL))
+			GREATEST_FAIL();
+
+		for (size_t i = 0; i < max; ++i) {
+			if (total) {
+				GREATEST_ASSERT(images[i].timestamp <= last.timestamp);
+				GREATEST_ASSERT(images[i].timestamp < last.timestamp ||
+				    strcmp(images[i].id, last.id) < 0);
+			}
+
+			image_finish(&last);
+			last = images[i];
+			total++;
+		}
+	} while (max == NELEM(images));
+
+	GREATEST_ASSERT_EQ(total, 5);
+	image_finish(&last);
+	GREATEST_PASS();
+}
+
+GREATEST_TEST
+recents_isid(void)
+{
+	struct image image = {
+		.title = estrdup("test"),
+		.author = estrdup("unit test"),
+		.filename = estrdup("image.png"),
+		.data = estrdup("PNG..."),
+		.datasz = 6,
+		.duration = IMAGE_DURATION_HOUR,
+		.visible = true
+	};
+
+	if (!database_insert(&image))
+		GREATEST_FAIL();
+
+	GREATEST_ASSERT(database_isid(image.id));
+	GREATEST_ASSERT(database_isid("zzzzzzzzzzzz"));
+	GREATEST_ASSERT(!database_isid(""));
+	GREATEST_ASSERT(!database_isid("00000000000"));
+	GREATEST_ASSERT(!database_isid("0000000000000"));
+	GREATEST_ASSERT(!database_isid("00000000000A"));
+	GREATEST_ASSERT(!database_isid("00000000000-"));
+	image_finish(&image);
+	GREATEST_PASS();
+}
+
 GREATEST_SUITE(recents)
 {
 	GREATEST_SET_SETUP_CB(setup, NULL);
@@ -223,6 +358,8 @@ GREATEST_SUITE(recents)
 	GREATEST_RUN_TEST(recents_hidden);
 	GREATEST_RUN_TEST(recents_many);
 	GREATEST_RUN_TEST(recents_limits);
+	GREATEST_RUN_TEST(recents_before);
+	GREATEST_RUN_TEST(recents_isid);
 }
 
 GREATEST_TEST
@@ -254,6 +391,37 @@ get_basic(void)
 	GREATEST_PASS();
 }
 
+GREATEST_TEST
+get_meta(void)
+{
+	struct image original = {
+		.title = estrdup("test 1"),
+		.author = estrdup("unit test"),
+		.data = estrdup("PNG..."),
+		.datasz = 6,
+		.filename = estrdup("image.png"),
+		.duration = IMAGE_DURATION_HOUR,
+		.visible = true
+	};
+	struct image new = {0};
+
+	if (!database_insert(&original))
+		GREATEST_FAIL();
+	if (!database_get_meta(&new, original.id))
+		GREATEST_FAIL();
+
+	GREATEST_ASSERT_STR_EQ(new.id, original.id);
+	GREATEST_ASSERT_STR_EQ(new.title, original.title);
+	GREATEST_ASSERT_STR_EQ(new.author, original.author);
+	GREATEST_ASSERT(!new.data);
+	GREATEST_ASSERT_EQ(new.datasz, original.datasz);
+	GREATEST_ASSERT_STR_EQ(new.filename, original.filename);
+	GREATEST_ASSERT_EQ(new.duration, original.duration);
+	GREATEST_ASSERT_EQ(new.expires, new.timestamp + original.duration);
+	GREATEST_ASSERT_EQ(new.visible, original.visible);
+	GREATEST_PASS();
+}
+
 GREATEST_TEST
 get_nonexistent(void)
 {
@@ -271,12 +439,151 @@ get_nonexistent(void)
 	GREATEST_PASS();
 }
 
+struct stream {
+	unsigned char *data;
+	size_t datasz;
+	size_t chunks;
+};
+
+static bool
+stream_chunk(const void *data, size_t datasz, void *arg)
+{
+	struct stream *st = arg;
+
+	if (!(st->data = realloc(st->data, st->datasz + datasz)))
+		die("abort: %s", strerror(errno));
+
+	memcpy(st->data + st->datasz, data, datasz);
+	st->datasz += datasz;
+	st->chunks++;
+
+	return true;
+}
+
+GREATEST_TEST
+get_stream(void)
+{
+	struct image original = {
+		.title = estrdup("test 1"),
+		.author = estrdup("unit test"),
+		.datasz = 100000,
+		.filename = estrdup("image.png"),
+		.duration = IMAGE_DURATION_HOUR,
+		.visible = true
+	};
+	struct stream st = {0};
+
+	if (!(original.data = malloc(original.datasz)))
+		GREATEST_FAIL();
+
+	for (size_t i = 0; i < original.datasz; ++i)
+		((unsigned char *)original.data)[i] = i % 251;
+
+	if (!database_insert(&original))
+		GREATEST_FAIL();
+	if (!database_stream(original.id, stream_chunk, &st))
+		GREATEST_FAIL();
+
+	GREATEST_ASSERT(st.chunks > 1);
+	GREATEST_ASSERT_EQ(st.datasz, original.datasz);
+	GREATEST_ASSERT_MEM_EQ(st.data, original.data, original.datasz);
+	GREATEST_ASSERT(!database_stream("unknown", stream_chunk, &st));
+	free(st.data);
+	image_finish(&original);
+	GREATEST_PASS();
+}
+
 GREATEST_SUITE(get)
 {
 	GREATEST_SET_SETUP_CB(setup, NULL);
 	GREATEST_SET_TEARDOWN_CB(finish, NULL);
 	GREATEST_RUN_TEST(get_basic);
+	GREATEST_RUN_TEST(get_meta);
 	GREATEST_RUN_TEST(get_nonexistent);
+	GREATEST_RUN_TEST(get_stream);
+}
+
+/* Same as set_id in database.c. */
+static void
+next_id(char *id)
+{
+	static const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+	sqlite3_int64 value = 0;
+	unsigned char c;
+
+	for (size_t i = 0; i < 12; ) {
+		sqlite3_randomness(1, &c);
+
+		if (c < 256 - 256 % 36) {
+			value = value * 36 + c % 36;
+			i++;
+		}
+	}
+
+	for (int i = 11; i >= 0; --i) {
+		id[i] = digits[value % 36];
+		value /= 36;
+	}
+
+	id[12] = '\0';
+}
+
+GREATEST_TEST
+insert_collision(void)
+{
+	struct image first = {
+		.title = estrdup("Super Mario"),
+		.author = estrdup("Mario"),
+		.data = estrdup("PNG mario"),
+		.datasz = 9,
+		.filename = estrdup("mario.png"),
+		.duration = IMAGE_DURATION_HOUR
+	};
+	struct image second = {
+		.title = estrdup("Super Luigi"),
+		.author = estrdup("Luigi"),
+		.data = estrdup("PNG luigi"),
+		.datasz = 9,
+		.filename = estrdup("luigi.png"),
+		.duration = IMAGE_DURATION_HOUR
+	};
+	struct image new = {0};
+	char id[13];
+
+	/* Replay the random generator so that both draw the same identifier. */
+	sqlite3_test_control(SQLITE_TESTCTRL_PRNG_SAVE);
+
+	if (!database_insert(&first))
+		GREATEST_FAIL();
+
+	sqlite3_test_control(SQLITE_TESTCTRL_PRNG_RESTORE);
+
+	if (!database_insert(&second))
+		GREATEST_FAIL();
+
+	/* Make sure the second image tried the identifier of the first. */
+	sqlite3_test_control(SQLITE_TESTCTRL_PRNG_RESTORE);
+	next_id(id);
+
+	GREATEST_ASSERT_STR_EQ(id, first.id);
+	GREATEST_ASSERT(strcmp(first.id, second.id) != 0);
+	GREATEST_ASSERT_EQ(count("SELECT COUNT(*) FROM image"), 2);
+
+	if (!database_get(&new, second.id))
+		GREATEST_FAIL();
+
+	GREATEST_ASSERT_STR_EQ(new.title, "Super Luigi");
+	image_finish(&new);
+	image_finish(&first);
+	image_finish(&second);
+	GREATEST_PASS();
+}
+
+GREATEST_SUITE(insert)
+{
+	GREATEST_SET_SETUP_CB(setup, NULL);
+	GREATEST_SET_TEARDOWN_CB(finish, NULL);
+	GREATEST_RUN_TEST(insert_collision);
 }
 
 GREATEST_TEST
@@ -315,14 +622,14 @@ search_basic(void)
 	 * title = <any>
 	 * author = Mario,
 	 */
-	if (!database_search(searched, &max, NULL, "Mario"))
+	if (!database_search(searched, &max, NULL, "Mario", NULL))
 		GREATEST_FAIL();
 
 	GREATEST_ASSERT_EQ(max, 1);
 	GREATEST_ASSERT(searched[0].id);
 	GREATEST_ASSERT_STR_EQ(searched[0].title, "Super Mario");
 	GREATEST_ASSERT_STR_EQ(searched[0].author, "Mario");
-	GREATEST_ASSERT_MEM_EQ(searched[0].data, "PNG mario", 9);
+	GREATEST_ASSERT(!searched[0].data);
 	GREATEST_ASSERT_EQ(searched[0].datasz, 9);
 	GREATEST_ASSERT_STR_EQ(searched[0].filename, "mario.png");
 	GREATEST_ASSERT_EQ(searched[0].duration, IMAGE_DURATION_HOUR);
@@ -354,7 +661,7 @@ search_notfound(void)
 	 * title = <any>
 	 * author = jean,
 	 */
-	if (!database_search(&searched, &max, NULL, "jean"))
+	if (!database_search(&searched, &max, NULL, "jean", NULL))
 		GREATEST_FAIL();
 
 	GREATEST_ASSERT_EQ(max, 0);
@@ -393,7 +700,7 @@ search_private(void)
 	 * title = <any>
 	 * author = <any>
 	 */
-	if (!database_search(&searched, &max, NULL, NULL))
+	if (!database_search(&searched, &max, NULL, NULL, NULL))
 		GREATEST_FAIL();
 
 	GREATEST_ASSERT_EQ(max, 0);
@@ -408,6 +715,107 @@ search_private(void)
 	GREATEST_PASS();
 }
 
+GREATEST_TEST
+search_substring(void)
+{
+	struct image searched[3] = {0};
+	struct image image = {
+		.duration = IMAGE_DURATION_HOUR,
+		.visible = true
+	};
+	static const char * const titles[] = {
+		"Mario Kart",
+		"Super Mario Bros",
+		"Mario \"The\" Mario"
+	};
+	size_t max = 3;
+
+	for (size_t i = 0; i < NELEM(titles); ++i) {
+		image.title = estrdup(titles[i]);
+		image.author = estrdup("Nintendo");
+		image.data = estrdup("PNG...");
+		image.datasz = 6;
+		image.filename = estrdup("mario.png");
+
+		if (!database_insert(&image))
+			GREATEST_FAIL();
+	}
+
+	/* Case insensitive and in the middle of a word. */
+	if (!database_search(searched, &max, "ARIO", "tend", NULL))
+		GREATEST_FAIL();
+
+	GREATEST_ASSERT_EQ(max, 3);
+
+	max = 3;
+
+	if (!database_search(searched, &max, "\"The\"", NULL, NULL))
+		GREATEST_FAIL();
+
+	GREATEST_ASSERT_EQ(max, 1);
+	GREATEST_ASSERT_STR_EQ(searched[0].title, "Mario \"The\" Mario");
+
+	/* Too short for trigrams. */
+	max = 3;
+
+	if (!database_search(searched, &max, "Ka", NULL, NULL))
+		GREATEST_FAIL();
+
+	GREATEST_ASSERT_EQ(max, 1);
+	GREATEST_ASSERT_STR_EQ(searched[0].title, "Mario Kart");
+	GREATEST_PASS();
+}
+
+GREATEST_TEST
+search_wildcard(void)
+{
+	struct image searched[3] = {0};
+	struct image image = {
+		.duration = IMAGE_DURATION_HOUR,
+		.visible = true
+	};
+	static const char * const titles[] = {
+		"100% Mario",
+		"Luigi",
+		"Peach_Toad"
+	};
+	size_t max = 3;
+
+	for (size_t i = 0; i < NELEM(titles); ++i) {
+		image.title = estrdup(titles[i]);
+		image.author = estrdup("Nintendo");
+		image.data = estrdup("PNG...");
+		image.datasz = 6;
+		image.filename = estrdup("mario.png");
+
+		if (!database_insert(&image))
+			GREATEST_FAIL();
+	}
+
+	/* Short queries use LIKE, its wildcards must match literally. */
+	if (!database_search(searched, &max, "%", NULL, NULL))
+		GREATEST_FAIL();
+
+	GREATEST_ASSERT_EQ(max, 1);
+	GREATEST_ASSERT_STR_EQ(searched[0].title, "100% Mario");
+
+	max = 3;
+
+	if (!database_search(searched, &max, "_", NULL, NULL))
+		GREATEST_FAIL();
+
+	GREATEST_ASSERT_EQ(max, 1);
+	GREATEST_ASSERT_STR_EQ(searched[0].title, "Peach_Toad");
+
+	max = 3;
+
+	if (!database_search(searched, &max, "\\", NULL, NULL))
+		GREATEST_FAIL();
+
+	GREATEST_ASSERT_EQ(max, 0);
+	GREATEST_PASS();
+}
+
 GREATEST_SUITE(search)
 {
 	GREATEST_SET_SETUP_CB(setup, NULL);
@@ -415,6 +823,8 @@ GREATEST_SUITE(search)
 	GREATEST_RUN_TEST(search_basic);
 	GREATEST_RUN_TEST(search_notfound);
 	GREATEST_RUN_TEST(search_private);
+	GREATEST_RUN_TEST(search_substring);
+	GREATEST_RUN_TEST(search_wildcard);
 }
 
 GREATEST_TEST
@@ -465,20 +875,23 @@ clear_run(void)
 	sleep(2);
 	database_clear();
 
+	/* Image data must have been removed too. */
+	GREATEST_ASSERT_EQ(count("SELECT COUNT(*) FROM image_data"), 1);
+
 	/*
 	 * Search:
 	 *
 	 * title = <any>
 	 * author = <any>
 	 */
-	if (!database_search(&searched, &max, NULL, NULL))
+	if (!database_search(&searched, &max, NULL, NULL, NULL))
 		GREATEST_FAIL();
 
 	GREATEST_ASSERT_EQ(max, 1);
 	GREATEST_ASSERT(searched.id);
 	GREATEST_ASSERT_STR_EQ(searched.title, "Bowser");
 	GREATEST_ASSERT_STR_EQ(searched.author, "Bowser");
-	GREATEST_ASSERT_MEM_EQ(searched.data, "PNG bowser", 10);
+	GREATEST_ASSERT(!searched.data);
 	GREATEST_ASSERT_EQ(searched.datasz, 10);
 	GREATEST_ASSERT_STR_EQ(searched.filename, "bowser.png");
 	GREATEST_ASSERT_EQ(searched.duration, IMAGE_DURATION_HOUR);
@@ -493,6 +906,728 @@ GREATEST_SUITE(clear)
 	GREATEST_RUN_TEST(clear_run);
 }
 
+#define TEST_BLOBS "test-blobs"
+
+static void
+setup_fs(void *data)
+{
+	if (system("rm -rf " TEST_BLOBS) != 0)
+		die("abort: could not remove " TEST_BLOBS);
+
+	snprintf(config.storage, sizeof (config.storage), "fs");
+	snprintf(config.blobdir, sizeof (config.blobdir), TEST_BLOBS);
+	setup(data);
+}
+
+static void
+finish_fs(void *data)
+{
+	finish(data);
+	snprintf(config.storage, sizeof (config.storage), "sqlite");
+}
+
+static bool
+blob_exists(const char *hash)
+{
+	return access(bprintf(TEST_BLOBS "/%.2s/%s", hash, hash), F_OK) == 0;
+}
+
+GREATEST_TEST
+storage_fs_basic(void)
+{
+	struct image image = {
+		.title = estrdup("Super Mario"),
+		.author = estrdup("Mario"),
+		.data = estrdup("PNG mario"),
+		.datasz = 9,
+		.filename = estrdup("mario.png"),
+		.duration = IMAGE_DURATION_HOUR,
+		.visible = true
+	};
+	struct image new = {0};
+	struct stream st = {0};
+	char path[PATH_MAX];
+	off_t offset;
+	size_t datasz;
+
+	if (!database_insert(&image))
+		GREATEST_FAIL();
+
+	/* sha256("PNG mario") */
+	GREATEST_ASSERT_STR_EQ(image.hash,
+	    "2cd3bb76f63de6a6ba2e659659c07d2c2f7b3eef8ccdc5d60438d094da5d2337");
+	GREATEST_ASSERT(blob_exists(image.hash));
+	GREATEST_ASSERT_EQ(count("SELECT COUNT(*) FROM image_data"), 0);
+
+	if (!database_locate(image.id, path, sizeof (path), &offset, &datasz))
+		GREATEST_FAIL();
+
+	GREATEST_ASSERT_STR_EQ(path, bprintf(TEST_BLOBS "/%.2s/%s", image.hash, image.hash));
+	GREATEST_ASSERT_EQ(offset, 0);
+	GREATEST_ASSERT_EQ(datasz, 9);
+
+	if (!database_get(&new, image.id))
+		GREATEST_FAIL();
+
+	GREATEST_ASSERT_EQ(new.datasz, 9);
+	GREATEST_ASSERT_MEM_EQ(new.data, "PNG mario", 9);
+
+	if (!database_stream(image.id, stream_chunk, &st))
+		GREATEST_FAIL();
+
+	GREATEST_ASSERT_EQ(st.datasz, 9);
+	GREATEST_ASSERT_MEM_EQ(st.data, "PNG mario", 9);
+	free(st.data);
+	image_finish(&new);
+	image_finish(&image);
+	GREATEST_PASS();
+}
+
+GREATEST_TEST
+storage_fs_clear(void)
+{
+	struct image images[] = {
+		/* Expired but shares its file with the next one. */
+		{ .data = "PNG mario", .datasz = 9, .duration = 0 },
+		{ .data = "PNG mario", .datasz = 9, .duration = IMAGE_DURATION_HOUR },
+		/* Expired alone. */
+		{ .data = "PNG luigi", .datasz = 9, .duration = 0 }
+	};
+
+	if (!populate(images, NELEM(images)))
+		GREATEST_FAIL();
+
+	database_clear();
+
+	GREATEST_ASSERT_EQ(count("SELECT COUNT(*) FROM image"), 1);
+	GREATEST_ASSERT(blob_exists(images[1].hash));
+	GREATEST_ASSERT(!blob_exists(images[2].hash));
+	GREATEST_PASS();
+}
+
+GREATEST_TEST
+storage_fs_sweep(void)
+{
+	struct image image = {
+		.title = estrdup("test"),
+		.author = estrdup("unit test"),
+		.data = estrdup("PNG mario"),
+		.datasz = 9,
+		.filename = estrdup("image.png"),
+		.duration = IMAGE_DURATION_HOUR
+	};
+
+	if (!database_insert(&image))
+		GREATEST_FAIL();
+
+	/* As if a clear stopped between both transactions. */
+	count("DELETE FROM image");
+	GREATEST_ASSERT(blob_exists(image.hash));
+
+	database_clear();
+	GREATEST_ASSERT(!blob_exists(image.hash));
+	GREATEST_ASSERT_EQ(count("SELECT COUNT(*) FROM blob"), 0);
+
+	image_finish(&image);
+	GREATEST_PASS();
+}
+
+static void
+setup_pack(void *data)
+{
+	if (system("rm -rf " TEST_BLOBS) != 0)
+		die("abort: could not remove " TEST_BLOBS);
+
+	snprintf(config.storage, sizeof (config.storage), "pack");
+	snprintf(config.blobdir, sizeof (config.blobdir), TEST_BLOBS);
+	setup(data);
+}
+
+static void
+setup_memory(void *data)
+{
+	database_register_storage(&storage_memory);
+	snprintf(config.storage, sizeof (config.storage), "memory");
+	setup(data);
+}
+
+static bool
+pack_exists(unsigned int pack)
+{
+	return access(bprintf(TEST_BLOBS "/pack-%08u", pack), F_OK) == 0;
+}
+
+GREATEST_TEST
+storage_pack_basic(void)
+{
+	struct image image = {
+		.title = estrdup("Super Mario"),
+		.author = estrdup("Mario"),
+		.data = estrdup("PNG mario"),
+		.datasz = 9,
+		.filename = estrdup("mario.png"),
+		.duration = IMAGE_DURATION_HOUR,
+		.visible = true
+	};
+	struct image new = {0};
+	struct stream st = {0};
+
+	if (!database_insert(&image))
+		GREATEST_FAIL();
+
+	GREATEST_ASSERT(pack_exists(0));
+	GREATEST_ASSERT(!blob_exists(image.hash));
+	GREATEST_ASSERT_EQ(count("SELECT COUNT(*) FROM image_data"), 0);
+	GREATEST_ASSERT_EQ(count("SELECT COUNT(*) FROM image_pack"), 1);
+
+	if (!database_get(&new, image.id))
+		GREATEST_FAIL();
+
+	GREATEST_ASSERT_EQ(new.datasz, 9);
+	GREATEST_ASSERT_MEM_EQ(new.data, "PNG mario", 9);
+
+	if (!database_stream(image.id, stream_chunk, &st))
+		GREATEST_FAIL();
+
+	GREATEST_ASSERT_EQ(st.datasz, 9);
+	GREATEST_ASSERT_MEM_EQ(st.data, "PNG mario", 9);
+	free(st.data);
+	image_finish(&new);
+	image_finish(&image);
+	GREATEST_PASS();
+}
+
+GREATEST_TEST
+storage_pack_compact(void)
+{
+	struct image images[] = {
+		{ .data = "PNG mario", .datasz = 9, .duration = 0 },
+		{ .data = "PNG luigi", .datasz = 9, .duration = IMAGE_DURATION_HOUR },
+		{ .data = "PNG peach", .datasz = 9, .duration = 0 }
+	};
+	struct image new = {0};
+
+	if (!populate(images, NELEM(images)))
+		GREATEST_FAIL();
+
+	database_clear();
+
+	/* Two thirds of the pack are unused. */
+	database_compact(90);
+	GREATEST_ASSERT(pack_exists(0));
+	database_compact(50);
+	GREATEST_ASSERT(pack_exists(1));
+
+	/* Kept until the next run for the readers still using it. */
+	GREATEST_ASSERT(pack_exists(0));
+	database_compact(50);
+	GREATEST_ASSERT(!pack_exists(0));
+	GREATEST_ASSERT(pack_exists(1));
+	GREATEST_ASSERT_EQ(count("SELECT COUNT(*) FROM image_pack WHERE pack = 1 AND start = 0"), 1);
+
+	if (!database_get(&new, images[1].id))
+		GREATEST_FAIL();
+
+	GREATEST_ASSERT_MEM_EQ(new.data, "PNG luigi", 9);
+	image_finish(&new);
+
+	/* New images go to the rewritten pack. */
+	if (!database_insert(&images[0]))
+		GREATEST_FAIL();
+
+	GREATEST_ASSERT_EQ(count("SELECT COUNT(*) FROM image_pack WHERE pack = 1 AND start = 9"), 1);
+	GREATEST_PASS();
+}
+
+GREATEST_TEST
+storage_pack_empty(void)
+{
+	struct image image = {
+		.title = estrdup("test"),
+		.author = estrdup("unit test"),
+		.data = estrdup("PNG mario"),
+		.datasz = 9,
+		.filename = estrdup("image.png"),
+		.duration = 0
+	};
+
+	if (!database_insert(&image))
+		GREATEST_FAIL();
+
+	database_clear();
+	GREATEST_ASSERT(pack_exists(0));
+
+	/* Nothing left to move, the pack is only removed. */
+	database_compact(100);
+	GREATEST_ASSERT(!pack_exists(0));
+	GREATEST_ASSERT(!pack_exists(1));
+
+	image_finish(&image);
+	GREATEST_PASS();
+}
+
+GREATEST_TEST
+storage_pack_locate(void)
+{
+	struct image images[] = {
+		{ .data = "PNG mario", .datasz = 9, .duration = IMAGE_DURATION_HOUR },
+		{ .data = "PNG luigi!", .datasz = 10, .duration = IMAGE_DURATION_HOUR }
+	};
+	char path[PATH_MAX];
+	off_t offset;
+	size_t datasz;
+
+	if (!populate(images, NELEM(images)))
+		GREATEST_FAIL();
+
+	/* Both in the same pack, one after the other. */
+	if (!database_locate(images[1].id, path, sizeof (path), &offset, &datasz))
+		GREATEST_FAIL();
+
+	GREATEST_ASSERT_STR_EQ(path, TEST_BLOBS "/pack-00000000");
+	GREATEST_ASSERT_EQ(offset, 9);
+	GREATEST_ASSERT_EQ(datasz, 10);
+
+	/* Too small for the path. */
+	GREATEST_ASSERT(!database_locate(images[1].id, path, 4, &offset, &datasz));
+	GREATEST_PASS();
+}
+
+GREATEST_TEST
+storage_memory_basic(void)
+{
+	struct image image = {
+		.title = estrdup("Super Mario"),
+		.author = estrdup("Mario"),
+		.data = estrdup("PNG mario"),
+		.datasz = 9,
+		.filename = estrdup("mario.png"),
+		.duration = 0,
+		.visible = true
+	};
+	struct image new = {0};
+	struct stream st = {0};
+	char path[PATH_MAX];
+	off_t offset;
+	size_t datasz;
+
+	if (!database_insert(&image))
+		GREATEST_FAIL();
+
+	GREATEST_ASSERT_EQ(count("SELECT COUNT(*) FROM image_data"), 0);
+	GREATEST_ASSERT_EQ(count("SELECT COUNT(*) FROM image_pack"), 0);
+
+	/* Not in a file. */
+	GREATEST_ASSERT(!database_locate(image.id, path, sizeof (path), &offset, &datasz));
+
+	if (!database_get(&new, image.id))
+		GREATEST_FAIL();
+
+	GREATEST_ASSERT_EQ(new.datasz, 9);
+	GREATEST_ASSERT_MEM_EQ(new.data, "PNG mario", 9);
+
+	if (!database_stream(image.id, stream_chunk, &st))
+		GREATEST_FAIL();
+
+	GREATEST_ASSERT_EQ(st.datasz, 9);
+	GREATEST_ASSERT_MEM_EQ(st.data, "PNG mario", 9);
+
+	/* Expired right away. */
+	database_clear();
+	GREATEST_ASSERT(!database_stream(image.id, stream_chunk, &st));
+
+	free(st.data);
+	image_finish(&new);
+	image_finish(&image);
+	GREATEST_PASS();
+}
+
+GREATEST_TEST
+storage_dedup(void)
+{
+	struct image images[] = {
+		/* Expired but shares its data with the next one. */
+		{ .data = "PNG mario", .datasz = 9, .duration = 0 },
+		{ .data = "PNG mario", .datasz = 9, .duration = IMAGE_DURATION_HOUR },
+		/* Expired alone. */
+		{ .data = "PNG luigi", .datasz = 9, .duration = 0 }
+	};
+	struct image new = {0};
+
+	if (!populate(images, NELEM(images)))
+		GREATEST_FAIL();
+
+	GREATEST_ASSERT_EQ(count("SELECT COUNT(*) FROM image_data"), 2);
+	GREATEST_ASSERT_EQ(count("SELECT MAX(refs) FROM blob"), 2);
+
+	database_clear();
+
+	GREATEST_ASSERT_EQ(count("SELECT COUNT(*) FROM image"), 1);
+	GREATEST_ASSERT_EQ(count("SELECT COUNT(*) FROM image_data"), 1);
+	GREATEST_ASSERT_EQ(count("SELECT COUNT(*) FROM blob WHERE refs = 1"), 1);
+
+	if (!database_get(&new, images[1].id))
+		GREATEST_FAIL();
+
+	GREATEST_ASSERT_MEM_EQ(new.data, "PNG mario", 9);
+	image_finish(&new);
+	GREATEST_PASS();
+}
+
+GREATEST_TEST
+storage_batch(void)
+{
+	struct image images[] = {
+		{ .data = "PNG mario", .datasz = 9, .duration = IMAGE_DURATION_HOUR },
+		{ .data = "PNG luigi", .datasz = 9, .duration = IMAGE_DURATION_HOUR },
+		/* Stored by the first one, in the same transaction. */
+		{ .data = "PNG mario", .datasz = 9, .duration = IMAGE_DURATION_HOUR }
+	};
+	struct image new = {0};
+
+	fixture(images, NELEM(images));
+	GREATEST_ASSERT_EQ(database_insert_all(images, NELEM(images)), NELEM(images));
+	GREATEST_ASSERT_EQ(count("SELECT COUNT(*) FROM image"), 3);
+	GREATEST_ASSERT_EQ(count("SELECT COUNT(*) FROM image_data"), 2);
+	GREATEST_ASSERT_EQ(count("SELECT MAX(refs) FROM blob"), 2);
+
+	for (size_t i = 0; i < NELEM(images); ++i) {
+		GREATEST_ASSERT(images[i].id);
+		GREATEST_ASSERT_EQ(images[i].expires, images[i].timestamp + IMAGE_DURATION_HOUR);
+
+		if (!database_get(&new, images[i].id))
+			GREATEST_FAIL();
+
+		GREATEST_ASSERT_MEM_EQ(new.data, images[i].data, 9);
+		image_finish(&new);
+	}
+
+	GREATEST_PASS();
+}
+
+GREATEST_SUITE(storage)
+{
+	GREATEST_SET_SETUP_CB(setup_fs, NULL);
+	GREATEST_SET_TEARDOWN_CB(finish_fs, NULL);
+	GREATEST_RUN_TEST(storage_fs_basic);
+	GREATEST_RUN_TEST(storage_fs_clear);
+	GREATEST_RUN_TEST(storage_fs_sweep);
+	GREATEST_SET_SETUP_CB(setup_pack, NULL);
+	GREATEST_RUN_TEST(storage_pack_basic);
+	GREATEST_RUN_TEST(storage_pack_compact);
+	GREATEST_RUN_TEST(storage_pack_empty);
+	GREATEST_RUN_TEST(storage_pack_locate);
+	GREATEST_SET_SETUP_CB(setup_memory, NULL);
+	GREATEST_RUN_TEST(storage_memory_basic);
+	GREATEST_SET_SETUP_CB(setup, NULL);
+	GREATEST_RUN_TEST(storage_dedup);
+	GREATEST_RUN_TEST(storage_batch);
+}
+
+/*
+ * Every thread opens its own connections, inserts an image and reads it
+ * back while the main thread keeps its connections open.
+ */
+static void *
+thread_insert(void *data)
+{
+	struct image *image = data;
+	struct image found = {0};
+	bool *ret;
+
+	if (!(ret = calloc(1, sizeof (*ret))))
+		die("abort: %s", strerror(errno));
+	if (database_open(TEST_DATABASE) && database_insert(image) &&
+	    database_get(&found, image->id))
+		*ret = found.datasz == image->datasz &&
+		    memcmp(found.data, image->data, image->datasz) == 0;
+
+	image_finish(&found);
+	database_finish();
+
+	return ret;
+}
+
+GREATEST_TEST
+thread_basic(void)
+{
+	struct image images[4] = {0};
+	struct image recents[4];
+	pthread_t threads[4];
+	size_t max = NELEM(recents);
+	void *ret;
+
+	for (size_t i = 0; i < NELEM(images); ++i) {
+		images[i].title = estrdup(bprintf("thread %zu", i));
+		images[i].author = estrdup("unit test");
+		images[i].filename = estrdup("image.png");
+		images[i].data = estrdup(bprintf("PNG %zu", i));
+		images[i].datasz = 5;
+		images[i].duration = IMAGE_DURATION_HOUR;
+		images[i].visible = true;
+
+		if (pthread_create(&threads[i], NULL, thread_insert, &images[i]) != 0)
+			GREATEST_FAIL();
+	}
+
+	for (size_t i = 0; i < NELEM(images); ++i) {
+		pthread_join(threads[i], &ret);
+		GREATEST_ASSERT(*(bool *)ret);
+		free(ret);
+		image_finish(&images[i]);
+	}
+
+	/* Still usable from this thread. */
+	if (!database_recents(recents, &max, NULL))
+		GREATEST_FAIL();
+
+	GREATEST_ASSERT_EQ(max, 4);
+
+	for (size_t i = 0; i < max; ++i)
+		image_finish(&recents[i]);
+
+	GREATEST_PASS();
+}
+
+GREATEST_SUITE(thread)
+{
+	GREATEST_SET_SETUP_CB(setup, NULL);
+	GREATEST_SET_TEARDOWN_CB(finish, NULL);
+	GREATEST_RUN_TEST(thread_basic);
+}
+
+/*
+ * Create a database using the schema from imgup 0.1.0 which did not have
+ * any versioning.
+ */
+static void
+setup_legacy(void *data)
+{
+	sqlite3 *db;
+
+	remove(TEST_DATABASE);
+	remove(TEST_DATABASE "-shm");
+	remove(TEST_DATABASE "-wal");
+
+	if (sqlite3_open(TEST_DATABASE, &db) != SQLITE_OK)
+		die("abort: could not open database");
+	if (sqlite3_exec(db,
+	    "CREATE TABLE image(\n"
+	    "  id TEXT PRIMARY KEY,\n"
+	    "  title TEXT,\n"
+	    "  author TEXT,\n"
+	    "  data BLOB,\n"
+	    "  filename TEXT,\n"
+	    "  date INT DEFAULT CURRENT_TIMESTAMP,\n"
+	    "  visible INTEGER DEFAULT 0,\n"
+	    "  duration INT\n"
+	    ");\n"
+	    "INSERT INTO image(id, title, author, data, filename, visible, duration)\n"
+	    "     VALUES ('abcdefghijkl', 'Peach', 'Toad', 'PNG peach',\n"
+	    "             'peach.png', 1, 3600);",
+	    NULL, NULL, NULL) != SQLITE_OK)
+		die("abort: could not create legacy database");
+
+	sqlite3_close(db);
+
+	if (!database_open(TEST_DATABASE))
+		die("abort: could not open database");
+
+	(void)data;
+}
+
+GREATEST_TEST
+migrate_legacy(void)
+{
+	struct image images[10];
+	struct image image = {0};
+	size_t max = 10;
+
+	if (!database_get(&image, "abcdefghijkl"))
+		GREATEST_FAIL();
+
+	GREATEST_ASSERT_STR_EQ(image.title, "Peach");
+	GREATEST_ASSERT_STR_EQ(image.author, "Toad");
+	GREATEST_ASSERT_MEM_EQ(image.data, "PNG peach", 9);
+	GREATEST_ASSERT_EQ(image.datasz, 9);
+	GREATEST_ASSERT_STR_EQ(image.filename, "peach.png");
+	GREATEST_ASSERT_EQ(image.duration, IMAGE_DURATION_HOUR);
+	GREATEST_ASSERT(labs(time(NULL) - image.timestamp) < 60);
+	GREATEST_ASSERT_EQ(image.expires, image.timestamp + IMAGE_DURATION_HOUR);
+	GREATEST_ASSERT_EQ(count("SELECT COUNT(*) FROM image WHERE typeof(date) = 'integer'"), 1);
+	GREATEST_ASSERT(image.visible);
+
+	if (!database_recents(images, &max, NULL))
+		GREATEST_FAIL();
+
+	GREATEST_ASSERT_EQ(max, 1);
+	GREATEST_ASSERT_STR_EQ(images[0].id, "abcdefghijkl");
+	GREATEST_ASSERT(!images[0].data);
+	GREATEST_ASSERT_EQ(images[0].datasz, 9);
+	GREATEST_PASS();
+}
+
+GREATEST_TEST
+migrate_reopen(void)
+{
+	struct image image = {0};
+
+	/* Opening again must not try to migrate twice. */
+	database_finish();
+
+	if (!database_open(TEST_DATABASE))
+		GREATEST_FAIL();
+	if (!database_get(&image, "abcdefghijkl"))
+		GREATEST_FAIL();
+
+	GREATEST_ASSERT_MEM_EQ(image.data, "PNG peach", 9);
+	GREATEST_PASS();
+}
+
+GREATEST_TEST
+migrate_readonly(void)
+{
+	struct image image = {0};
+	struct image inserted = {
+		.title = estrdup("Bowser"),
+		.author = estrdup("Bowser"),
+		.data = estrdup("PNG bowser"),
+		.datasz = 10,
+		.filename = estrdup("bowser.png"),
+		.duration = IMAGE_DURATION_HOUR
+	};
+
+	/* Already up to date, must not require any write. */
+	database_finish();
+
+	if (!database_open_readonly(TEST_DATABASE))
+		GREATEST_FAIL();
+	if (!database_get(&image, "abcdefghijkl"))
+		GREATEST_FAIL();
+
+	GREATEST_ASSERT_MEM_EQ(image.data, "PNG peach", 9);
+	GREATEST_ASSERT(!database_insert(&inserted));
+
+	image_finish(&image);
+	image_finish(&inserted);
+	GREATEST_PASS();
+}
+
+GREATEST_TEST
+migrate_missing(void)
+{
+	struct image images[1];
+	size_t imagesz = NELEM(images);
+
+	/* A fresh install serves pages before the first upload. */
+	database_finish();
+	remove(TEST_DATABASE);
+	remove(TEST_DATABASE "-shm");
+	remove(TEST_DATABASE "-wal");
+
+	if (!database_open_readonly(TEST_DATABASE))
+		GREATEST_FAIL();
+	if (!database_recents(images, &imagesz, NULL))
+		GREATEST_FAIL();
+
+	GREATEST_ASSERT_EQ(imagesz, 0);
+	GREATEST_ASSERT_EQ(access(TEST_DATABASE, F_OK), 0);
+	GREATEST_PASS();
+}
+
+GREATEST_TEST
+migrate_wal(void)
+{
+	GREATEST_ASSERT_EQ(count("SELECT COUNT(*) FROM pragma_journal_mode WHERE journal_mode = 'wal'"), 1);
+	GREATEST_PASS();
+}
+
+GREATEST_SUITE(migrate)
+{
+	GREATEST_SET_SETUP_CB(setup_legacy, NULL);
+	GREATEST_SET_TEARDOWN_CB(finish, NULL);
+	GREATEST_RUN_TEST(migrate_legacy);
+	GREATEST_RUN_TEST(migrate_reopen);
+	GREATEST_RUN_TEST(migrate_readonly);
+	GREATEST_RUN_TEST(migrate_missing);
+	GREATEST_RUN_TEST(migrate_wal);
+}
+
+/*
+ * Make sure the query runs through the given index and that SQLite neither
+ * scans the table nor sorts the result by itself.
+ */
+static enum greatest_test_res
+check_plan(const char *name, const char *index)
+{
+	const char *plan;
+
+	if (!(plan = database_explain(name)))
+		GREATEST_FAILm(name);
+
+	GREATEST_ASSERTm(plan, !strstr(plan, "SCAN"));
+	GREATEST_ASSERTm(plan, !strstr(plan, "TEMP B-TREE"));
+
+	if (index)
+		GREATEST_ASSERTm(plan, strstr(plan, bprintf(" INDEX %s ", index)));
+
+	GREATEST_PASS();
+}
+
+GREATEST_TEST
+plan_get(void)
+{
+	const char *plan;
+
+	GREATEST_CHECK_CALL(check_plan("get", NULL));
+
+	/* A single search on the rowid, without identifier index. */
+	plan = database_explain("get");
+	GREATEST_ASSERTm(plan, strstr(plan, "SEARCH image USING INTEGER PRIMARY KEY"));
+	GREATEST_PASS();
+}
+
+GREATEST_TEST
+plan_recents(void)
+{
+	GREATEST_CHECK_CALL(check_plan("recents", "image_visible_date"));
+	GREATEST_PASS();
+}
+
+GREATEST_TEST
+plan_search(void)
+{
+	const char *plan;
+
+	/*
+	 * Matches are sorted by date once found, the cost depends on their
+	 * number rather than the table size.
+	 */
+	if (!(plan = database_explain("search")))
+		GREATEST_FAIL();
+
+	GREATEST_ASSERTm(plan, strstr(plan, "SCAN image_search VIRTUAL TABLE INDEX 0:M"));
+	GREATEST_ASSERTm(plan, strstr(plan, "SEARCH image USING INTEGER PRIMARY KEY"));
+	GREATEST_PASS();
+}
+
+GREATEST_TEST
+plan_clear(void)
+{
+	GREATEST_CHECK_CALL(check_plan("clear", "image_expires_at"));
+	GREATEST_PASS();
+}
+
+GREATEST_SUITE(plan)
+{
+	GREATEST_SET_SETUP_CB(setup, NULL);
+	GREATEST_SET_TEARDOWN_CB(finish, NULL);
+	GREATEST_RUN_TEST(plan_get);
+	GREATEST_RUN_TEST(plan_recents);
+	GREATEST_RUN_TEST(plan_search);
+	GREATEST_RUN_TEST(plan_clear);
+}
+
 GREATEST_MAIN_DEFS();
 
 int
@@ -501,7 +1636,12 @@ main(int argc, char **argv)
 	GREATEST_MAIN_BEGIN();
 	GREATEST_RUN_SUITE(recents);
 	GREATEST_RUN_SUITE(get);
+	GREATEST_RUN_SUITE(insert);
 	GREATEST_RUN_SUITE(search);
 	GREATEST_RUN_SUITE(clear);
+	GREATEST_RUN_SUITE(storage);
+	GREATEST_RUN_SUITE(thread);
+	GREATEST_RUN_SUITE(migrate);
+	GREATEST_RUN_SUITE(plan);
 	GREATEST_MAIN_END();
 }
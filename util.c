@@ -72,12 +72,34 @@ ememdup(const void *src, size_t length)
 	return memcpy(ptr, src, length);
 }
 
+/*
+ * Parse a whole decimal number from the command line or the environment,
+ * what names the option in the error message.
+ */
+long long
+estrtonum(const char *value, long long min, long long max, const char *what)
+{
+	assert(value);
+	assert(what);
+
+	char *end;
+	long long n;
+
+	errno = 0;
+	n = strtoll(value, &end, 10);
+
+	if (end == value || *end || errno == ERANGE || n < min || n > max)
+		die("abort: invalid %s: %s\n", what, value);
+
+	return n;
+}
+
 const char *
 bprintf(const char *fmt, ...)
 {
 	assert(fmt);
 
-	static char buf[BUFSIZ];
+	static _Thread_local char buf[BUFSIZ];
 	va_list ap;
 
 	va_start(ap, fmt);
@@ -93,7 +115,7 @@ bstrftime(const char *fmt, const struct tm *tm)
 	assert(fmt);
 	assert(tm);
 
-	static char buf[BUFSIZ];
+	static _Thread_local char buf[BUFSIZ];
 
 	strftime(buf, sizeof (buf), fmt, tm);
 
@@ -106,7 +128,7 @@ path(const char *filename)
 	assert(filename);
 
 	/* Build path to the template file. */
-	static char path[PATH_MAX];
+	static _Thread_local char path[PATH_MAX];
 
 	snprintf(path, sizeof (path), "%s/%s", config.themedir, filename);
 
@@ -130,10 +152,9 @@ replace(char **dst, const char *s)
 }
 
 const char *
-ttl(time_t timestamp, long long int duration)
+ttl(time_t expires)
 {
-	const time_t now = time(NULL);
-	const long long int left = duration - difftime(now, timestamp);
+	const long long int left = difftime(expires, time(NULL));
 
 	if (left < IMAGE_DURATION_HOUR)
 		return bprintf("%lld minute(s)", left / 60);
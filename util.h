@@ -35,6 +35,9 @@ estrdup(const char *);
 void *
 ememdup(const void *, size_t);
 
+long long
+estrtonum(const char *, long long, long long, const char *);
+
 const char *
 bprintf(const char *, ...);
 
@@ -48,6 +51,6 @@ void
 replace(char **, const char *);
 
 const char *
-ttl(time_t, long long int);
+ttl(time_t);
 
 #endif /* !IMGUP_UTIL_H */
@@ -0,0 +1,510 @@
+/*
+ * writer.c -- single process inserting uploads
+ *
+ * Copyright (c) 2020-2023 David Demelier <markand@malikania.fr>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "database.h"
+#include "image.h"
+#include "log.h"
+#include "util.h"
+#include "writer.h"
+
+/*
+ * Both ends run on the same host from the same build so numbers are sent in
+ * native byte order. The header is followed by the title, author and
+ * filename without their terminating NUL and then by the image data.
+ */
+struct request {
+	uint32_t titlesz;
+	uint32_t authorsz;
+	uint32_t filenamesz;
+	uint32_t visible;
+	int64_t duration;
+	uint64_t datasz;
+};
+
+/* The id is left empty if the image could not be inserted. */
+struct reply {
+	char id[16];
+	int64_t timestamp;
+};
+
+static volatile sig_atomic_t running;
+
+static bool
+address(struct sockaddr_un *sun, const char *path)
+{
+	memset(sun, 0, sizeof (*sun));
+	sun->sun_family = AF_UNIX;
+
+	if (strlen(path) >= sizeof (sun->sun_path)) {
+		log_warn("writer: socket path too long: %s", path);
+		return false;
+	}
+
+	strcpy(sun->sun_path, path);
+
+	return true;
+}
+
+static bool
+send_all(int fd, const void *data, size_t datasz)
+{
+	const unsigned char *p = data;
+	ssize_t nw;
+
+	while (datasz) {
+		if ((nw = send(fd, p, datasz, MSG_NOSIGNAL)) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return false;
+		}
+
+		p += nw;
+		datasz -= nw;
+	}
+
+	return true;
+}
+
+static bool
+recv_all(int fd, void *data, size_t datasz)
+{
+	unsigned char *p = data;
+	ssize_t nr;
+
+	while (datasz) {
+		if ((nr = recv(fd, p, datasz, 0)) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return false;
+		}
+		if (nr == 0) {
+			errno = ECONNRESET;
+			return false;
+		}
+
+		p += nr;
+		datasz -= nr;
+	}
+
+	return true;
+}
+
+static uint32_t
+length(const char *s)
+{
+	return s ? strlen(s) : 0;
+}
+
+bool
+writer_insert(const char *path, struct image *image)
+{
+	assert(path);
+	assert(image);
+
+	struct sockaddr_un sun;
+	struct request req = {
+		.titlesz        = length(image->title),
+		.authorsz       = length(image->author),
+		.filenamesz     = length(image->filename),
+		.visible        = image->visible,
+		.duration       = image->duration,
+		.datasz         = image->datasz
+	};
+	struct reply rep;
+	struct timeval tv = { .tv_sec = WRITER_TIMEOUT };
+	int fd = -1;
+
+	if (!address(&sun, path))
+		return false;
+
+	/*
+	 * Fail the upload rather than holding the worker if the writer is
+	 * stalled, this also applies to connect when its backlog is full.
+	 */
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv)) < 0 ||
+	    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv)) < 0)
+		goto err;
+	if (connect(fd, (struct sockaddr *)&sun, sizeof (sun)) < 0)
+		goto err;
+
+	if (!send_all(fd, &req, sizeof (req)) ||
+	    !send_all(fd, image->title, req.titlesz) ||
+	    !send_all(fd, image->author, req.authorsz) ||
+	    !send_all(fd, image->filename, req.filenamesz) ||
+	    !send_all(fd, image->data, image->datasz) ||
+	    !recv_all(fd, &rep, sizeof (rep)))
+		goto err;
+
+	close(fd);
+	rep.id[sizeof (rep.id) - 1] = '\0';
+
+	if (!rep.id[0]) {
+		log_warn("writer: image not inserted");
+		return false;
+	}
+
+	free(image->id);
+	image->id = estrdup(rep.id);
+	image->timestamp = rep.timestamp;
+	image->expires = rep.timestamp + image->duration;
+
+	return true;
+
+err:
+	log_warn("writer: %s: %s", path, strerror(errno));
+
+	if (fd >= 0)
+		close(fd);
+
+	return false;
+}
+
+/*
+ * Upload being received, the strings and the data are read at once in a
+ * single buffer and split once complete.
+ */
+struct client {
+	int fd;
+	time_t deadline;
+	struct request req;
+	size_t reqsz;
+	unsigned char *body;
+	size_t bodysz;
+	size_t bodylen;
+};
+
+static void
+drop(struct client *c, const char *reason)
+{
+	if (reason)
+		log_warn("writer: %s", reason);
+
+	close(c->fd);
+	free(c->body);
+	memset(c, 0, sizeof (*c));
+	c->fd = -1;
+}
+
+/* Sizes come from the client, don't die on allocation failures. */
+static char *
+split(const unsigned char **p, uint32_t length)
+{
+	char *s;
+
+	if (!(s = malloc((size_t)length + 1)))
+		return NULL;
+
+	memcpy(s, *p, length);
+	s[length] = '\0';
+	*p += length;
+
+	return s;
+}
+
+/* Move a complete request into an image, the client is left to reply. */
+static bool
+unpack(struct client *c, struct image *image)
+{
+	const unsigned char *p = c->body;
+
+	memset(image, 0, sizeof (*image));
+	image->visible = c->req.visible;
+	image->duration = c->req.duration;
+	image->datasz = c->req.datasz;
+
+	if (!(image->title = split(&p, c->req.titlesz)) ||
+	    !(image->author = split(&p, c->req.authorsz)) ||
+	    !(image->filename = split(&p, c->req.filenamesz)) ||
+	    !(image->data = malloc(image->datasz ? image->datasz : 1))) {
+		image_finish(image);
+		return false;
+	}
+
+	memcpy(image->data, p, image->datasz);
+	free(c->body);
+	c->body = NULL;
+
+	return true;
+}
+
+/*
+ * Read what is available without blocking, return true once the request
+ * is complete.
+ */
+static bool
+receive(struct client *c)
+{
+	ssize_t nr;
+	uint64_t total;
+
+	if (c->reqsz < sizeof (c->req)) {
+		nr = recv(c->fd, (unsigned char *)&c->req + c->reqsz,
+		    sizeof (c->req) - c->reqsz, 0);
+
+		if (nr <= 0)
+			goto err;
+		if ((c->reqsz += nr) < sizeof (c->req))
+			return false;
+
+		total = (uint64_t)c->req.titlesz + c->req.authorsz +
+		    c->req.filenamesz + c->req.datasz;
+
+		if (c->req.datasz > SIZE_MAX || total > SIZE_MAX ||
+		    !(c->body = malloc(total ? total : 1))) {
+			drop(c, "invalid request");
+			return false;
+		}
+
+		c->bodysz = total;
+	}
+
+	if (c->bodylen < c->bodysz) {
+		nr = recv(c->fd, c->body + c->bodylen, c->bodysz - c->bodylen, 0);
+
+		if (nr <= 0)
+			goto err;
+
+		c->bodylen += nr;
+	}
+
+	return c->bodylen == c->bodysz;
+
+err:
+	if (nr < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return false;
+
+	drop(c, nr == 0 ? "client disconnected" : strerror(errno));
+
+	return false;
+}
+
+static void
+reply(int fd, const struct image *image)
+{
+	struct reply rep = {0};
+
+	if (image->id) {
+		snprintf(rep.id, sizeof (rep.id), "%s", image->id);
+		rep.timestamp = image->timestamp;
+	}
+
+	if (!send_all(fd, &rep, sizeof (rep)))
+		log_warn("writer: unable to reply: %s", strerror(errno));
+}
+
+static void
+stop(int sig)
+{
+	(void)sig;
+
+	running = 0;
+}
+
+/*
+ * Tell if another instance is already listening on the socket, in which case
+ * it must be left alone.
+ */
+static bool
+listening(const struct sockaddr_un *sun)
+{
+	int fd;
+	bool ret;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return false;
+
+	ret = connect(fd, (const struct sockaddr *)sun, sizeof (*sun)) == 0;
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * Insert the uploads completely received together and reply to their
+ * clients.
+ */
+static void
+commit(struct client *clients, size_t nclients)
+{
+	struct image images[WRITER_BATCH];
+	struct client *ready[WRITER_BATCH];
+	size_t n = 0;
+
+	for (size_t i = 0; i < nclients; ++i) {
+		if (clients[i].fd < 0 || !clients[i].body ||
+		    clients[i].bodylen != clients[i].bodysz)
+			continue;
+		if (!unpack(&clients[i], &images[n])) {
+			drop(&clients[i], "not enough memory");
+			continue;
+		}
+
+		ready[n++] = &clients[i];
+	}
+
+	if (!n)
+		return;
+
+	log_debug("writer: inserting %zu images", n);
+	database_insert_all(images, n);
+
+	for (size_t i = 0; i < n; ++i) {
+		reply(ready[i]->fd, &images[i]);
+		drop(ready[i], NULL);
+		image_finish(&images[i]);
+	}
+}
+
+bool
+writer_run(const char *path)
+{
+	assert(path);
+
+	struct sockaddr_un sun;
+	struct sigaction sa = {0};
+	struct pollfd pfds[1 + WRITER_BATCH];
+	struct client clients[WRITER_BATCH] = {0};
+	time_t now, next;
+	int fd;
+
+	if (!address(&sun, path))
+		return false;
+	if (listening(&sun)) {
+		log_warn("writer: %s: already in use", path);
+		return false;
+	}
+
+	/* Left over by a previous instance. */
+	unlink(path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	    fcntl(fd, F_SETFL, O_NONBLOCK) < 0 ||
+	    bind(fd, (struct sockaddr *)&sun, sizeof (sun)) < 0 ||
+	    listen(fd, SOMAXCONN) < 0) {
+		log_warn("writer: %s: %s", path, strerror(errno));
+
+		if (fd >= 0)
+			close(fd);
+
+		return false;
+	}
+
+	/* Without SA_RESTART so that poll returns. */
+	sa.sa_handler = stop;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	for (size_t i = 0; i < WRITER_BATCH; ++i)
+		clients[i].fd = -1;
+
+	log_info("writer: listening on %s", path);
+
+	/*
+	 * Uploads are read without blocking as their data arrives, each one
+	 * must be complete within WRITER_TIMEOUT seconds so that a stalled
+	 * client can't hold the others. Those completed while the previous
+	 * batch was committing are inserted together.
+	 */
+	for (running = 1; running; ) {
+		size_t npfds = 1;
+		int timeout = -1;
+
+		now = time(NULL);
+		pfds[0].fd = fd;
+		pfds[0].events = 0;
+
+		for (size_t i = 0; i < WRITER_BATCH; ++i) {
+			if (clients[i].fd < 0) {
+				pfds[0].events = POLLIN;
+				continue;
+			}
+
+			next = clients[i].deadline > now ? clients[i].deadline - now : 0;
+
+			if (timeout < 0 || next * 1000 < timeout)
+				timeout = next * 1000;
+
+			pfds[npfds].fd = clients[i].fd;
+			pfds[npfds++].events = POLLIN;
+		}
+
+		if (poll(pfds, npfds, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			log_warn("writer: %s", strerror(errno));
+			break;
+		}
+
+		now = time(NULL);
+
+		for (size_t i = 0; i < WRITER_BATCH; ++i) {
+			if (clients[i].fd < 0)
+				continue;
+			if (clients[i].deadline <= now)
+				drop(&clients[i], "request timed out");
+			else
+				receive(&clients[i]);
+		}
+
+		for (size_t i = 0; i < WRITER_BATCH; ++i) {
+			if (clients[i].fd >= 0)
+				continue;
+			if ((clients[i].fd = accept(fd, NULL, NULL)) < 0)
+				break;
+
+			/* Some systems don't inherit it from the listener. */
+			fcntl(clients[i].fd, F_SETFL,
+			    fcntl(clients[i].fd, F_GETFL) | O_NONBLOCK);
+			clients[i].deadline = now + WRITER_TIMEOUT;
+			receive(&clients[i]);
+		}
+
+		commit(clients, WRITER_BATCH);
+	}
+
+	log_info("writer: exiting");
+
+	for (size_t i = 0; i < WRITER_BATCH; ++i)
+		if (clients[i].fd >= 0)
+			drop(&clients[i], NULL);
+
+	close(fd);
+	unlink(path);
+
+	return true;
+}
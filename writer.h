@@ -0,0 +1,67 @@
+/*
+ * writer.h -- single process inserting uploads
+ *
+ * Copyright (c) 2020-2023 David Demelier <markand@malikania.fr>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef IMGUP_WRITER_H
+#define IMGUP_WRITER_H
+
+/*
+ * Rather than having every imgupd process wait for the database write lock,
+ * uploads can be handed over a local UNIX socket to imgupd-writer which is
+ * the only one writing. Uploads received while a transaction is committing
+ * are inserted together in the next one.
+ */
+
+#include <stdbool.h>
+
+/*
+ * Maximum number of uploads inserted in a single transaction.
+ */
+#define WRITER_BATCH 64
+
+/*
+ * Seconds given to a client to send its whole upload, also the longest a
+ * client waits for the writer to make any progress.
+ */
+#define WRITER_TIMEOUT 10
+
+struct image;
+
+/**
+ * Send an image to the writer listening on the given socket and wait for it
+ * to be inserted, like database_insert the image id, timestamp and
+ * expiration are set on success. Fails if the writer doesn't make progress
+ * within WRITER_TIMEOUT seconds.
+ *
+ * \param path the socket path
+ * \param image the image to insert
+ * \return false on errors
+ */
+bool
+writer_insert(const char *, struct image *);
+
+/**
+ * Listen on the given socket and insert the images received until SIGINT
+ * or SIGTERM, the database must be opened for writing.
+ *
+ * \param path the socket path
+ * \return false if the socket could not be created
+ */
+bool
+writer_run(const char *);
+
+#endif /* !IMGUP_WRITER_H */